@@ -0,0 +1,239 @@
+//  Benchmarks for the text editor object model.
+//
+//  Every benchmark runs on documents of 1 MB, 32 MB and 1 GB. Besides the
+//  time per operation, each reports the heap allocations per operation
+//  and the peak resident set size of the process so far.
+//
+//    cmake -S bench -B bench/build && cmake --build bench/build
+//    bench/build/txed_bench --benchmark_filter=Keystroke
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <benchmark/benchmark.h>
+
+#include "txed.h"
+
+namespace {
+
+std::atomic<std::size_t> allocations(0);
+
+}
+
+// kept out of line, as GCC would otherwise see malloc and free meet new
+// and delete once they are inlined and warn of a mismatch
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  ++allocations;
+
+  if (void* p = std::malloc(size ? size : 1)) return p;
+
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](std::size_t size) { return operator new(size); }
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+using namespace text_edit;
+
+typedef text_history<std::string> history;
+
+// random lines of letters, so that searches and line counts have something to find
+std::string make_string(std::size_t length) {
+  std::mt19937 random(1);
+  std::string result(length, ' ');
+
+  for (auto& c : result) {
+    auto const r = random() % 64;
+    c = r == 0 ? '\n' : static_cast<char>('a' + r % 26);
+  }
+
+  return result;
+}
+
+// a document after edits random keystrokes, fragmented the way a real session leaves it
+std::unique_ptr<history> make_history(std::size_t length, std::size_t edits) {
+  std::unique_ptr<history> result(new history(make_string(length)));
+  std::mt19937 random(2);
+
+  for (std::size_t k = 0; k < edits; ++k) {
+    auto const offset = random() % result->current().length();
+
+    if (k % 4 == 3) result->erase(offset, std::min(offset + 1, result->current().length()));
+    else result->insert(offset, "x");
+  }
+
+  return result;
+}
+
+class counters {
+  private:
+    benchmark::State& m_state;
+    std::size_t const m_allocations;
+
+  public:
+    explicit counters(benchmark::State& state):
+      m_state(state),
+      m_allocations(allocations)
+    {}
+
+    ~counters() {
+      rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+
+      m_state.counters["allocs/op"] = benchmark::Counter(
+        static_cast<double>(allocations - m_allocations),
+        benchmark::Counter::kAvgIterations
+      );
+
+      m_state.counters["peak_rss_mb"] = static_cast<double>(usage.ru_maxrss) / 1024;
+    }
+};
+
+void keystroke(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+  std::mt19937 random(3);
+
+  h->set_limits(history_limits { 1000, static_cast<std::size_t>(-1) });
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    h->insert(random() % h->current().length(), "x");
+  }
+}
+
+void lazy_keystroke(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+  std::mt19937 random(3);
+
+  h->set_limits(history_limits { 1000, static_cast<std::size_t>(-1) });
+  h->set_lazy(true);
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    h->insert(random() % h->current().length(), "x");
+  }
+}
+
+void replace_all(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+  std::string const needle = "abc";
+  auto const hits = h->current().find_all(needle);
+  text_string<std::string> const patch("xyzzy");
+
+  std::vector<replacement_step<std::string> > steps;
+  for (auto offset : hits) steps.push_back(replacement_step<std::string> { offset, offset + needle.length(), &patch, 0, patch.length() });
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    text_batch_replacement<std::string> const result(&h->current(), steps);
+    benchmark::DoNotOptimize(result.length());
+  }
+
+  state.counters["replacements"] = static_cast<double>(steps.size());
+}
+
+void find_all(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(h->current().find_all("abc").size());
+  }
+
+  state.SetBytesProcessed(state.iterations() * h->current().length());
+}
+
+void sequential_scan(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+  auto const& text = h->current();
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    std::size_t newlines = 0;
+    for (auto it = text.begin(); it != text.end(); ++it) newlines += *it == '\n';
+    benchmark::DoNotOptimize(newlines);
+  }
+
+  state.SetBytesProcessed(state.iterations() * text.length());
+}
+
+void random_access(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+  auto const& text = h->current();
+  std::mt19937 random(4);
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(text.at(random() % text.length()));
+  }
+}
+
+void to_string(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+
+  counters const c(state);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(h->current().to_string().length());
+  }
+
+  state.SetBytesProcessed(state.iterations() * h->current().length());
+}
+
+void undo_redo(benchmark::State& state) {
+  auto const h = make_history(state.range(0), 1000);
+  auto const depth = h->size() - 1;
+
+  counters const c(state);
+
+  // each revision is read, as an editor redraws it
+  for (auto _ : state) {
+    for (std::size_t k = 0; k < depth; ++k) {
+      h->undo();
+      benchmark::DoNotOptimize(h->current().line_count());
+    }
+
+    for (std::size_t k = 0; k < depth; ++k) {
+      h->redo();
+      benchmark::DoNotOptimize(h->current().line_count());
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * depth * 2);
+}
+
+void sizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(32)->Range(1 << 20, 1 << 30);
+}
+
+BENCHMARK(keystroke)->Apply(sizes);
+BENCHMARK(lazy_keystroke)->Apply(sizes);
+BENCHMARK(replace_all)->Apply(sizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(find_all)->Apply(sizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(sequential_scan)->Apply(sizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(random_access)->Apply(sizes);
+BENCHMARK(to_string)->Apply(sizes)->Unit(benchmark::kMillisecond);
+BENCHMARK(undo_redo)->Apply(sizes)->Unit(benchmark::kMicrosecond);
+
+}
+
+BENCHMARK_MAIN();
@@ -0,0 +1,197 @@
+//  Anchors followed through random replacements and moves, directly and
+//  through apply() on the edits of a history, must be where a plain list
+//  of offsets updated one by one puts them.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "txed.h"
+
+namespace {
+
+using namespace text_edit;
+
+typedef std::string S;
+typedef text_anchors<S> anchors;
+
+// an anchor as the model keeps it
+struct model_anchor {
+  S::size_type offset;
+  anchors::gravity side;
+  bool live;
+};
+
+void model_replace(std::vector<model_anchor>& model, S::size_type cut_from, S::size_type cut_to, S::size_type patch_length) {
+  for (auto& a : model) {
+    if (!a.live) continue;
+
+    if (a.offset > cut_to) a.offset = a.offset - (cut_to - cut_from) + patch_length;
+    else if (a.offset >= cut_from) a.offset = a.side == anchors::sticks_left ? cut_from : cut_from + patch_length;
+  }
+}
+
+void model_move(std::vector<model_anchor>& model, S::size_type from, S::size_type to, S::size_type target) {
+  if (from <= target && target <= to) return;
+
+  for (auto& a : model) {
+    if (!a.live) continue;
+
+    auto& o = a.offset;
+    auto const left = a.side == anchors::sticks_left;
+
+    if (o >= from && o < to) {
+      o = target < from ? target + (o - from) : o + (target - to);
+    } else if (target < from) {
+      if ((o > target || (o == target && !left)) && o < from) o += to - from;
+    } else if (o >= to && (o < target || (o == target && left))) {
+      o -= to - from;
+    }
+  }
+}
+
+int failures = 0;
+
+bool agree(anchors const& a, std::vector<model_anchor> const& model, char const* what, int round, int step) {
+  for (anchors::anchor_id id = 0; id < model.size(); ++id) {
+    if (model[id].live && a.offset(id) != model[id].offset) {
+      std::fprintf(stderr, "%s, round %d, step %d: anchor %u at %zu, not %zu\n",
+        what, round, step, id, static_cast<std::size_t>(a.offset(id)), static_cast<std::size_t>(model[id].offset));
+      ++failures;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void add(anchors& a, std::vector<model_anchor>& model, S::size_type offset, anchors::gravity side) {
+  auto const id = a.add(offset, side);
+
+  if (id >= model.size()) model.resize(id + 1);
+  model[id] = model_anchor { offset, side, true };
+}
+
+// the anchors' own operations
+void direct(std::mt19937& random) {
+  for (int round = 0; round < 100; ++round) {
+    anchors a;
+    std::vector<model_anchor> model;
+    S::size_type length = 1000;
+
+    for (int step = 0; step < 400; ++step) {
+      auto const from = random() % (length + 1);
+      auto const to = from + random() % (length - from + 1);
+
+      switch (random() % 6) {
+        case 0:
+        case 1:
+          add(a, model, random() % (length + 1), anchors::gravity(random() % 2));
+          break;
+
+        case 2:
+          if (!model.empty()) {
+            auto const id = random() % model.size();
+            if (model[id].live) a.remove(id), model[id].live = false;
+          }
+          break;
+
+        case 3:
+        case 4: {
+          auto const cut_to = random() % 3 == 0 ? from : to;
+          auto const patch_length = random() % 20;
+
+          a.replace(from, cut_to, patch_length);
+          model_replace(model, from, cut_to, patch_length);
+          length = length - (cut_to - from) + patch_length;
+          break;
+        }
+
+        case 5: {
+          auto const target = random() % (length + 1);
+
+          a.move(from, to, target);
+          model_move(model, from, to, target);
+          break;
+        }
+      }
+
+      if (a.size() != static_cast<std::size_t>(std::count_if(model.begin(), model.end(), [](model_anchor const& m) { return m.live; }))) {
+        std::fprintf(stderr, "direct, round %d, step %d: the number of anchors differs\n", round, step);
+        ++failures;
+      }
+
+      if (!agree(a, model, "direct", round, step)) break;
+    }
+  }
+}
+
+// the edits of a history, followed by apply()
+void edits(std::mt19937& random) {
+  for (int round = 0; round < 50; ++round) {
+    text_history<S> h(S(500, 'a'));
+    anchors a;
+    std::vector<model_anchor> model;
+
+    h.set_lazy(round % 2 == 1);
+
+    for (int k = 0; k < 40; ++k) add(a, model, random() % 501, anchors::gravity(k % 2));
+
+    for (int step = 0; step < 100; ++step) {
+      auto const length = h.current().length();
+      auto const from = random() % (length + 1);
+      auto const to = from + random() % (std::min<S::size_type>(length - from, 10) + 1);
+      auto const target = random() % (length + 1);
+
+      switch (random() % 4) {
+        case 0:
+          h.replace(from, to, "patch");
+          model_replace(model, from, to, 5);
+          break;
+
+        case 1:
+          h.move(from, to, target);
+          model_move(model, from, to, target);
+          break;
+
+        case 2:
+          h.duplicate(from, to, target);
+          model_replace(model, target, target, to - from);
+          break;
+
+        case 3: {
+          std::vector<text_cursor<S> > cursors;
+          for (S::size_type c = 0; c + 3 <= length; c += 50 + random() % 50) cursors.push_back(text_cursor<S> { c, c + 3 });
+
+          h.replace(cursors, "cursor");
+          for (auto it = cursors.rbegin(); it != cursors.rend(); ++it) model_replace(model, it->from, it->to, 6);
+          break;
+        }
+      }
+
+      if (!a.apply(h.current())) {
+        std::fprintf(stderr, "edits, round %d, step %d: apply() does not know the edit\n", round, step);
+        ++failures;
+        break;
+      }
+
+      if (!agree(a, model, "edits", round, step)) break;
+    }
+  }
+}
+
+}
+
+int main() {
+  std::mt19937 random(1);
+
+  direct(random);
+  edits(random);
+
+  if (failures) std::fprintf(stderr, "%d failures\n", failures);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
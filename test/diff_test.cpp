@@ -0,0 +1,96 @@
+//  Differences between revisions of a document, and between texts that
+//  share no strings: replacing the hunks of the old text with the parts of
+//  the new one they name must give the new text, and what lies between
+//  the hunks must be equal in both.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "txed.h"
+
+namespace {
+
+using namespace text_edit;
+
+typedef std::string S;
+
+int failures = 0;
+
+void check(text_object<S> const& a, text_object<S> const& b, char const* what, int round) {
+  auto const hunks = diff(a, b);
+  auto const old_text = a.to_string();
+  auto const new_text = b.to_string();
+
+  std::vector<replacement_step<S> > steps;
+  S::size_type old_end = 0;
+  S::size_type new_end = 0;
+  bool in_order = true;
+
+  for (auto const& h : hunks) {
+    in_order = in_order && h.cut_from >= old_end && h.patch_from >= new_end && h.cut_from <= h.cut_to && h.patch_from <= h.patch_to;
+
+    // the text between two hunks is the same on both sides
+    in_order = in_order && h.cut_from - old_end == h.patch_from - new_end &&
+      old_text.compare(old_end, h.cut_from - old_end, new_text, new_end, h.patch_from - new_end) == 0;
+
+    steps.push_back(replacement_step<S> { h.cut_from, h.cut_to, &b, h.patch_from, h.patch_to });
+    old_end = h.cut_to;
+    new_end = h.patch_to;
+  }
+
+  in_order = in_order && old_text.compare(old_end, S::npos, new_text, new_end, S::npos) == 0;
+
+  if (!in_order) {
+    std::fprintf(stderr, "round %d, %s: the hunks are out of order or miss a difference\n", round, what);
+    ++failures;
+    return;
+  }
+
+  if (text_batch_replacement<S>(&a, steps).to_string() != new_text) {
+    std::fprintf(stderr, "round %d, %s: applying the hunks does not give the new text\n", round, what);
+    ++failures;
+  }
+}
+
+}
+
+int main() {
+  std::mt19937 random(1);
+
+  for (int round = 0; round < 200; ++round) {
+    text_history<S> h(S("the quick brown fox\njumps over\nthe lazy dog\n"));
+
+    for (int step = 0; step < 40; ++step) {
+      auto const length = h.current().length();
+      auto const from = random() % (length + 1);
+      auto const to = from + random() % (std::min<S::size_type>(length - from, 6) + 1);
+      auto const target = random() % (length + 1);
+
+      switch (random() % 5) {
+        case 0: h.insert(from, "x"); break;
+        case 1: h.erase(from, to); break;
+        case 2: h.replace(from, to, "the"); break;
+        case 3: h.duplicate(from, to, target); break;
+        case 4: h.move(from, to, target); break;
+      }
+    }
+
+    auto const first = random() % h.size();
+    auto const second = random() % h.size();
+
+    check(h.text(first), h.text(second), "revisions", round);
+    check(h.text(second), h.text(first), "revisions backwards", round);
+
+    // equal characters in strings of their own are found by comparing them
+    text_string<S> const copy(h.text(second).to_string());
+    check(h.text(first), copy, "separate strings", round);
+  }
+
+  if (failures) std::fprintf(stderr, "%d failures\n", failures);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
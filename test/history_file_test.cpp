@@ -0,0 +1,188 @@
+//  Saving edit histories and mapping them back: a history made of random
+//  edits must come back with the same revisions, texts and links, and a
+//  damaged or crafted file must raise history_file_error rather than load
+//  a rope that does not hold together.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "txed.h"
+#include "txed_file.h"
+
+namespace {
+
+using namespace text_edit;
+
+typedef text_history<std::string> history;
+typedef history_file<std::string> file;
+
+int failures = 0;
+
+void fail(char const* what, int round) {
+  std::fprintf(stderr, "round %d: %s\n", round, what);
+  ++failures;
+}
+
+std::string read_file(std::string const& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(std::string const& path, std::string const& content) {
+  std::ofstream(path, std::ios::binary | std::ios::trunc).write(content.data(), content.size());
+}
+
+// a history of random edits on several branches
+void edit(history& h, std::mt19937& random, int steps) {
+  for (int step = 0; step < steps; ++step) {
+    auto const length = h.current().length();
+    auto const from = random() % (length + 1);
+    auto const to = from + random() % (length - from + 1);
+    auto const target = random() % (length + 1);
+
+    switch (random() % 8) {
+      case 0: h.insert(from, "typed"); break;
+      case 1: h.erase(from, to); break;
+      case 2: h.replace(from, to, "replaced"); break;
+      case 3: h.duplicate(from, to, target); break;
+      case 4: h.move(from, to, target); break;
+      case 5: h.paste(target, h.copy(from, to)); break;
+      case 6: if (h.can_undo()) h.undo(); break;
+      case 7: h.jump(random() % h.size()); break;
+    }
+  }
+}
+
+bool same(history const& a, history& b) {
+  if (a.size() != b.size() || a.current_revision() != b.current_revision()) return false;
+
+  for (history::revision_id k = 0; k < a.size(); ++k) {
+    if (a.parent(k) != b.parent(k) || a.text(k).to_string() != b.text(k).to_string()) return false;
+  }
+
+  return true;
+}
+
+// whether redo goes to the same revision from every revision of both
+bool same_redo(history& a, history& b) {
+  for (history::revision_id k = 0; k < a.size(); ++k) {
+    a.jump(k);
+    b.jump(k);
+
+    if (a.can_redo() != b.can_redo()) return false;
+    if (!a.can_redo()) continue;
+
+    a.redo();
+    b.redo();
+
+    if (a.current_revision() != b.current_revision()) return false;
+  }
+
+  return true;
+}
+
+bool rejects(std::string const& path) {
+  try {
+    file::load(path);
+    return false;
+  } catch (history_file_error const&) {
+    return true;
+  }
+}
+
+// a file in the format of history_file, made of the given records, with one buffer of characters
+void craft(std::string const& path, std::vector<std::uint64_t> const& nodes, std::uint64_t characters, std::uint64_t root) {
+  std::string content("txedhst1");
+  std::vector<std::uint64_t> fields { 1, 1, nodes.size() / 5, 1, 0, characters, 0, characters };
+
+  fields.insert(fields.end(), nodes.begin(), nodes.end());
+  fields.push_back(root);
+  fields.push_back(static_cast<std::uint64_t>(-1));
+  fields.push_back(static_cast<std::uint64_t>(-1));
+
+  content.append(reinterpret_cast<char const*>(fields.data()), fields.size() * sizeof(std::uint64_t));
+  content.append(characters, 'a');
+
+  write_file(path, content);
+}
+
+}
+
+int main() {
+  std::string const path = "history_file_test.hst";
+  std::mt19937 random(1);
+
+  for (int round = 0; round < 30; ++round) {
+    history h(std::string("abcdefghij\nklmnopqrst\nuvwxyz"));
+    edit(h, random, 60);
+
+    file::save(h, path);
+    auto const loaded = file::load(path);
+
+    if (!same(h, *loaded)) fail("the loaded history differs", round);
+    if (!same_redo(h, *loaded)) fail("redo differs in the loaded history", round);
+
+    // editing goes on from the loaded history as from the saved one
+    h.jump(h.current_revision());
+    loaded->jump(h.current_revision());
+    h.insert(0, "more");
+    loaded->insert(0, "more");
+
+    if (h.current().to_string() != loaded->current().to_string()) fail("editing the loaded history differs", round);
+  }
+
+  // every truncation of a file
+  {
+    history h(std::string("abcdefghij"));
+    edit(h, random, 10);
+    file::save(h, path);
+
+    auto const content = read_file(path);
+
+    for (std::size_t size = 0; size < content.size(); ++size) {
+      write_file(path, content.substr(0, size));
+      if (!rejects(path)) fail("a truncated file loads", static_cast<int>(size));
+    }
+  }
+
+  // a node with the node before it as both children, doubling the length at every level
+  {
+    std::vector<std::uint64_t> nodes { 0, 0, 0, 0, 1 };
+    for (std::uint64_t k = 1; k < 70; ++k) nodes.insert(nodes.end(), { k, k, 0, 0, 1 });
+
+    craft(path, nodes, 1, 70);
+    if (!rejects(path)) fail("a file whose lengths overflow loads", 0);
+  }
+
+  // a segment longer than a rope allows
+  {
+    auto const length = rope<std::string>::max_segment_length + 1;
+
+    craft(path, { 0, 0, 0, 0, length }, length, 1);
+    if (!rejects(path)) fail("a file with an oversized segment loads", 0);
+  }
+
+  // a chain of left children
+  {
+    craft(path, { 0, 0, 0, 0, 1, 1, 0, 0, 0, 1, 2, 0, 0, 0, 1 }, 1, 3);
+    if (!rejects(path)) fail("an unbalanced file loads", 0);
+  }
+
+  // the smallest balanced tree loads
+  {
+    craft(path, { 0, 0, 0, 0, 1, 1, 1, 0, 0, 1 }, 1, 2);
+    if (rejects(path)) fail("a balanced file is rejected", 0);
+  }
+
+  std::remove(path.c_str());
+
+  if (failures) std::fprintf(stderr, "%d failures\n", failures);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+//  An edit history under a revision limit must take memory in proportion
+//  to its current text however long the session: the nodes the current
+//  rope keeps from old edits must not pin everything allocated with them.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+
+#include "txed.h"
+
+namespace {
+
+std::atomic<std::size_t> live_bytes(0);
+
+// room in front of every block for its size, keeping the block aligned
+std::size_t const header = alignof(std::max_align_t);
+
+}
+
+// kept out of line, as GCC would otherwise see through the size header
+// once they are inlined and warn of accesses out of bounds
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  if (auto const p = static_cast<char*>(std::malloc(size + header))) {
+    *reinterpret_cast<std::size_t*>(p) = size;
+    live_bytes += size;
+    return p + header;
+  }
+
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  if (!p) return;
+
+  auto const block = static_cast<char*>(p) - header;
+  live_bytes -= *reinterpret_cast<std::size_t*>(block);
+  std::free(block);
+}
+
+__attribute__((noinline)) void* operator new[](std::size_t size) { return operator new(size); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { operator delete(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
+namespace {
+
+using namespace text_edit;
+
+// random keystrokes, three characters typed for every one erased, as a
+// session leaves a document fragmented into ever more segments
+void type(text_history<std::string>& h, std::mt19937& random, std::size_t count) {
+  for (std::size_t k = 0; k < count; ++k) {
+    auto const offset = random() % h.current().length();
+
+    if (k % 4 == 3) h.erase(offset, offset + 1);
+    else h.insert(offset, "x");
+  }
+}
+
+// whether the live heap is within bound, for the scenario named
+bool within(char const* scenario, std::size_t bound) {
+  auto const live = live_bytes.load();
+
+  std::printf("%s: %zu KB live, %zu KB allowed\n", scenario, live >> 10, bound >> 10);
+
+  if (live <= bound) return true;
+
+  std::fprintf(stderr, "%s: memory grows with the number of edits\n", scenario);
+  return false;
+}
+
+bool keystrokes() {
+  std::string initial(1 << 20, 'a');
+  for (std::size_t k = 0; k < initial.length(); k += 64) initial[k] = '\n';
+
+  text_history<std::string> h(initial);
+  h.set_limits(history_limits { 100, static_cast<std::size_t>(-1) });
+
+  std::mt19937 random(1);
+
+  type(h, random, 60000);
+
+  // the text, the typed characters and the current rope, with room for the revisions kept
+  if (!within("keystrokes", 2 * initial.length() + 256 * h.current().get_rope().size() + (4 << 20))) return false;
+
+  // a copy of the text in one string is all that is left
+  h.flatten();
+
+  return within("flatten", 3 * initial.length() + (1 << 20));
+}
+
+// every copy shares the owners listed so far rather than a list of its own
+bool copy_and_paste() {
+  std::string model(1 << 10, 'a');
+  for (std::size_t k = 0; k < model.length(); ++k) model[k] = static_cast<char>('a' + k % 26);
+
+  text_history<std::string> h(model);
+  h.set_limits(history_limits { 100, static_cast<std::size_t>(-1) });
+
+  std::mt19937 random(2);
+
+  for (std::size_t k = 0; k < 20000; ++k) {
+    auto const from = random() % (model.length() - 8);
+    auto const offset = random() % (model.length() + 1);
+
+    h.paste(offset, h.copy(from, from + 8));
+    model.insert(offset, model.substr(from, 8));
+
+    if (k % 16 == 0) {
+      auto const typed_at = random() % (model.length() + 1);
+
+      h.insert(typed_at, "typed");
+      model.insert(typed_at, "typed");
+    }
+  }
+
+  if (h.current().to_string() != model) {
+    std::fprintf(stderr, "copy_and_paste: the text differs from the model\n");
+    return false;
+  }
+
+  // a clipboard and a link to its owners for every paste, besides what the keystrokes take
+  return within("copy_and_paste", 4 * model.length() + 256 * h.current().get_rope().size() + 20000 * 256 + (4 << 20));
+}
+
+// every edit undone leaves a branch of its own, which the limit must bound too
+bool undone_edits() {
+  text_history<std::string> h(std::string(1 << 10, 'a'));
+  h.set_limits(history_limits { 10, static_cast<std::size_t>(-1) });
+
+  for (std::size_t k = 0; k < 10000; ++k) {
+    h.insert(k % 1000, "x");
+    h.undo();
+  }
+
+  std::printf("undone_edits: %zu revisions kept\n", h.size());
+
+  if (h.size() > 10 || h.current().length() != 1 << 10) {
+    std::fprintf(stderr, "undone_edits: the branches are not bounded by the limit\n");
+    return false;
+  }
+
+  return true;
+}
+
+}
+
+int main() {
+  auto ok = keystrokes();
+  ok = copy_and_paste() && ok;
+  ok = undone_edits() && ok;
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
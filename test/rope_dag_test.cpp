@@ -0,0 +1,100 @@
+//  Ropes that share a node between several parts of the text, as
+//  duplicating a range leaves them: every window must read back the
+//  characters of the model string, whichever occurrence it ends in.
+//
+//    cmake -S test -B test/build && cmake --build test/build
+//    ctest --test-dir test/build
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "txed.h"
+#include "txed_parallel.h"
+
+namespace {
+
+using namespace text_edit;
+
+int failures = 0;
+
+void check(bool ok, char const* what, std::size_t from, std::size_t to) {
+  if (ok) return;
+
+  std::fprintf(stderr, "%s differs in [%zu, %zu)\n", what, from, to);
+  ++failures;
+}
+
+void check_window(text_object<std::string> const& text, std::string const& model, std::size_t from, std::size_t to) {
+  std::string copied(to - from, '\0');
+  auto const end = text.copy_to(&copied[0], from, to);
+
+  check(end == &copied[0] + (to - from) && copied == model.substr(from, to - from), "copy_to", from, to);
+
+  std::string spanned;
+  for (auto const& span : text.spans(from, to)) spanned.append(span.first, span.second);
+
+  check(spanned == model.substr(from, to - from), "spans", from, to);
+}
+
+// offsets of needle in model, as find_all reports them
+std::vector<std::size_t> find_all(std::string const& model, std::string const& needle) {
+  std::vector<std::size_t> result;
+
+  for (auto k = model.find(needle); k != std::string::npos; k = model.find(needle, k + needle.length())) {
+    result.push_back(k);
+  }
+
+  return result;
+}
+
+}
+
+int main() {
+  // the example from the report: the same node at offsets 7 and 26
+  {
+    text_history<std::string> h(std::string("abcdefghijklmnopqrs"));
+    std::string model = h.current().to_string();
+
+    h.duplicate(7, 12, 26 - 7);
+    model.insert(26 - 7, model.substr(7, 5));
+
+    for (std::size_t from = 0; from <= model.length(); ++from) {
+      for (std::size_t to = from; to <= model.length(); ++to) check_window(h.current(), model, from, to);
+    }
+  }
+
+  std::mt19937 random(1);
+
+  for (int round = 0; round < 50; ++round) {
+    text_history<std::string> h(std::string("abcab\ncabca\nbcabc"));
+    std::string model = h.current().to_string();
+
+    for (int step = 0; step < 12; ++step) {
+      auto const from = random() % (model.length() + 1);
+      auto const to = from + random() % (model.length() - from + 1);
+      auto const target = random() % (model.length() + 1);
+
+      h.duplicate(from, to, target);
+      model.insert(target, model.substr(from, to - from));
+    }
+
+    auto const& text = h.current();
+
+    for (int k = 0; k < 200; ++k) {
+      auto const from = random() % (model.length() + 1);
+      auto const to = from + random() % (model.length() - from + 1);
+      check_window(text, model, from, to);
+    }
+
+    check(text.find_all("abc") == find_all(model, "abc"), "find_all", 0, model.length());
+    check(parallel_find_all(text, std::string("abc"), 3) == find_all(model, "abc"), "parallel_find_all", 0, model.length());
+    check(parallel_count_lines(text, 3) == find_all(model, "\n").size() + 1, "parallel_count_lines", 0, model.length());
+  }
+
+  if (failures) std::fprintf(stderr, "%d failures\n", failures);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,43 @@
+//  A text streamed in as a million small chunks, as a network source
+//  appending packets leaves it: reading it back and releasing the chunks,
+//  through the builder or through a text taken half way, must work without
+//  running out of stack.
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "txed.h"
+
+using namespace text_edit;
+
+int main() {
+  std::size_t const chunks = 1000000;
+  std::shared_ptr<text_object<std::string> const> half;
+
+  {
+    text_stream_builder<std::string> builder;
+
+    for (std::size_t k = 0; k < chunks; ++k) {
+      builder.append(std::string(8, static_cast<char>('a' + k % 26)));
+      if (k + 1 == chunks / 2) half = builder.text();
+    }
+
+    auto const text = builder.text();
+
+    if (text->length() != 8 * chunks || text->at(8 * (chunks - 1)) != static_cast<char>('a' + (chunks - 1) % 26)) {
+      std::fprintf(stderr, "the text differs from the chunks appended\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (half->length() != 4 * chunks || half->at(4 * chunks - 1) != static_cast<char>('a' + (chunks / 2 - 1) % 26)) {
+    std::fprintf(stderr, "the text taken half way differs from the chunks appended by then\n");
+    return EXIT_FAILURE;
+  }
+
+  half.reset();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+//  A running search, updated by assignment after every keystroke the way
+//  an editor highlights matches as the user types, must find the same
+//  matches as a search of the whole text from scratch.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "txed.h"
+
+using namespace text_edit;
+
+int main() {
+  std::mt19937 random(1);
+  int failures = 0;
+
+  for (int round = 0; round < 20; ++round) {
+    text_history<std::string> h(std::string("abcabxabcab\nabcab"));
+    text_search<std::string> search(h.current(), "abca");
+
+    for (int step = 0; step < 200; ++step) {
+      auto const length = h.current().length();
+      auto const from = random() % (length + 1);
+      auto const to = std::min<std::size_t>(length, from + random() % 3);
+      std::string const typed[] = { "", "a", "b", "c", "ab", "bca" };
+
+      h.replace(from, to, typed[random() % 6]);
+      search = text_search<std::string>(search, dynamic_cast<text_replacement<std::string> const&>(h.current()));
+
+      if (search.hits() != h.current().find_all("abca") || &search.text() != &h.current()) {
+        std::fprintf(stderr, "round %d, step %d: the matches differ from find_all\n", round, step);
+        ++failures;
+      }
+    }
+  }
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
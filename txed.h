@@ -12,28 +12,59 @@
 //  vadim.vinnik@gmail.com
 //  2016
 
+#ifndef TXED_H
+#define TXED_H
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
-#include <map>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <boost/iterator/transform_iterator.hpp>
 #include <boost/operators.hpp>
 #include <boost/range/iterator_range_core.hpp>
-#include <boost/range/join.hpp>
 
 namespace text_edit {
 
 template<class TString>
 class text_object;
 
+template<class TString>
+class frozen_text;
+
+template<class TString>
+class history_file;
+
 class iterator_mismatch: public std::domain_error {
   public:
     iterator_mismatch(): std::domain_error("Cannot subtract or compare iterators pointing to different containers") {}
 };
 
+class unordered_replacements: public std::invalid_argument {
+  public:
+    unordered_replacements(): std::invalid_argument("Replaced ranges must be sorted and must not overlap") {}
+};
+
+class line_out_of_range: public std::out_of_range {
+  public:
+    line_out_of_range(): std::out_of_range("No line with such number in the text") {}
+};
+
+class revision_out_of_range: public std::out_of_range {
+  public:
+    revision_out_of_range(): std::out_of_range("No such revision in the edit history") {}
+};
+
 class text_out_of_range: public std::out_of_range {
   private:
     int const m_index;
@@ -66,9 +97,17 @@ class text_iterator:
     text_object<TString> const* m_target;
     typename TString::size_type m_current_index;
 
+    // the segment in which the current index was last found, so that
+    // dereferencing anywhere inside it needs no lookup in the rope
+    mutable typename TString::size_type m_segment_begin_offset;
+    mutable typename TString::size_type m_segment_end_offset;
+    mutable typename TString::const_iterator m_segment_begin;
+
     text_iterator(text_object<TString> const* target, typename TString::size_type current_index):
       m_target(target),
-      m_current_index(current_index)
+      m_current_index(current_index),
+      m_segment_begin_offset(0),
+      m_segment_end_offset(0)
     {}
 
     typename TString::difference_type diff(text_iterator<TString> const& it) const {
@@ -81,8 +120,14 @@ class text_iterator:
     void move(typename TString::difference_type d) { m_current_index += d; }
     void move_to(typename TString::size_type k) { m_current_index = k; }
 
+    bool in_segment() const {
+      return m_segment_begin_offset <= m_current_index && m_current_index < m_segment_end_offset;
+    }
+
+    void seek() const;
+
   public:
-    text_iterator(): m_target(nullptr) {}
+    text_iterator(): m_target(nullptr), m_segment_begin_offset(0), m_segment_end_offset(0) {}
 
     typename TString::size_type current_index() const { return m_current_index; }
 
@@ -116,278 +161,3143 @@ class text_iterator:
 template<class TString>
 using string_segment = std::pair<typename TString::const_iterator, typename TString::const_iterator>;
 
-template<class TString>
-using rope = std::map<typename TString::size_type, string_segment<TString> >;
-
-template<class TString>
-using rope_node = typename rope<TString>::value_type;
-
-template<class TString>
-class rope_node_trimmer {
+//  Pool allocator for rope nodes and decorators. Memory is taken from
+//  blocks that are released all at once when the arena is destroyed,
+//  which happens when the last object allocated in it is gone, as every
+//  such object keeps the arena alive. A freed slot goes back to the list
+//  for its size and is reused by the next allocation of that size, so a
+//  long-lived arena holds no more than the peak of what lives in it, and
+//  the nodes a rope keeps from old edits pin only their own slots.
+//  Deallocation may happen on any thread; allocation must be done by one
+//  thread at a time.
+class rope_arena {
   private:
-    typename TString::size_type m_new_begin_offset;
-    typename TString::size_type m_new_end_offset;
-    typename TString::difference_type m_shift;
+    struct free_slot {
+      free_slot* next;
+    };
+
+    // slot sizes are multiples of this, which every block start is aligned to
+    static std::size_t const granularity = alignof(std::max_align_t);
+    // anything larger comes from the heap
+    static std::size_t const size_classes = 32;
+
+    std::size_t const m_block_size;
+    std::vector<std::unique_ptr<char[]> > m_blocks;
+    char* m_next;
+    std::size_t m_left;
+    std::size_t m_reserved;
+    // taken by the allocating thread only
+    free_slot* m_free[size_classes];
+    // given back from any thread, then taken over in one piece
+    std::atomic<free_slot*> m_freed[size_classes];
+
+    rope_arena(rope_arena const&) = delete;
+    rope_arena& operator=(rope_arena const&) = delete;
+
+    static std::shared_ptr<rope_arena>& current_slot() {
+      static thread_local std::shared_ptr<rope_arena> arena;
+      return arena;
+    }
 
   public:
-    rope_node_trimmer(
-      typename TString::size_type new_begin_offset,
-      typename TString::size_type new_end_offset,
-      typename TString::difference_type shift
-    ):
-      m_new_begin_offset(new_begin_offset),
-      m_new_end_offset(new_end_offset),
-      m_shift(shift)
-    {}
+    static std::size_t const default_block_size = 1 << 14;
 
-    typename TString::size_type new_begin_offset() const { return m_new_begin_offset; }
-    typename TString::size_type new_end_offset() const { return m_new_end_offset; }
-    typename TString::difference_type shift() const { return m_shift; }
+    explicit rope_arena(std::size_t block_size = default_block_size):
+      m_block_size(block_size),
+      m_next(nullptr),
+      m_left(0),
+      m_reserved(0)
+    {
+      for (std::size_t k = 0; k < size_classes; ++k) {
+        m_free[k] = nullptr;
+        m_freed[k].store(nullptr, std::memory_order_relaxed);
+      }
+    }
 
-    rope_node<TString> operator()(rope_node<TString> const& x) const {
-      auto const& end_offset = x.first;
-      auto const& begin = x.second.first;
-      auto const& end = x.second.second;
-      auto const length = end - begin;
-      auto const begin_offset = end_offset - length;
+    void* allocate(std::size_t size, std::size_t alignment) {
+      assert(alignment <= granularity);
+      (void)alignment;
 
-      assert(end_offset >= m_new_begin_offset);
-      assert(begin_offset <= m_new_end_offset);
+      auto const k = (std::max<std::size_t>(size, 1) - 1) / granularity;
 
-      auto const begin_shift = std::max<typename TString::difference_type>(0, m_new_begin_offset - begin_offset);
-      auto const end_shift = std::min<typename TString::difference_type>(0, m_new_end_offset - end_offset);
-      auto const new_begin = begin + begin_shift;
-      auto const new_end = end + end_shift;
-      auto const new_end_offset = end_offset - m_new_begin_offset + end_shift + m_shift;
+      if (k >= size_classes) return ::operator new(size);
 
-      return rope_node<TString>(new_end_offset, string_segment<TString>(new_begin, new_end));
-    }
-};
+      if (!m_free[k]) m_free[k] = m_freed[k].exchange(nullptr, std::memory_order_acquire);
 
-template<class TString>
-class rope_trimmed_range {
-  public:
-    typedef
-      boost::transform_iterator<
-        rope_node_trimmer<TString>,
-        typename rope<TString>::const_iterator
-      >
-      iterator;
+      if (auto const slot = m_free[k]) {
+        m_free[k] = slot->next;
+        return slot;
+      }
 
-  private:
-    rope<TString> const* const m_base;
-    rope_node_trimmer<TString> m_trimmer;
+      auto const slot_size = (k + 1) * granularity;
 
-    iterator make_iterator(typename rope<TString>::const_iterator const& it) const {
-      return boost::make_transform_iterator(it, m_trimmer);
-    }
+      if (slot_size > m_left) {
+        auto const block_size = std::max(m_block_size, slot_size);
 
-  public:
-    rope_trimmed_range(
-      rope<TString> const* base, 
-      typename TString::size_type begin,
-      typename TString::size_type end,
-      typename TString::difference_type shift
-    ):
-      m_base(base),
-      m_trimmer(begin, end, shift)
-    {}
+        m_blocks.emplace_back(new char[block_size]);
+        m_next = m_blocks.back().get();
+        m_left = block_size;
+        m_reserved += block_size;
+      }
 
-    iterator begin() const { return make_iterator(m_base->upper_bound(m_trimmer.new_begin_offset())); }
+      auto const result = m_next;
+      m_next += slot_size;
+      m_left -= slot_size;
 
-    iterator end() const {
-      auto it = m_base->upper_bound(m_trimmer.new_end_offset());
+      return result;
+    }
 
-      if (it != m_base->end()) {
-        ++it;
+    void deallocate(void* p, std::size_t size) {
+      auto const k = (std::max<std::size_t>(size, 1) - 1) / granularity;
+
+      if (k >= size_classes) {
+        ::operator delete(p);
+        return;
       }
 
-      return make_iterator(it);
+      auto const slot = static_cast<free_slot*>(p);
+      slot->next = m_freed[k].load(std::memory_order_relaxed);
+
+      while (!m_freed[k].compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {}
     }
 
-    std::pair<iterator, iterator> range() const { return std::make_pair(begin(), end()); }
+    // bytes taken from the system so far
+    std::size_t reserved() const { return m_reserved; }
+
+    // arena that ropes built on this thread allocate their nodes in; none by default
+    static std::shared_ptr<rope_arena> const& current() { return current_slot(); }
+
+    // makes an arena current on this thread for the lifetime of the scope
+    class scope {
+      private:
+        std::shared_ptr<rope_arena> const m_previous;
+
+        scope(scope const&) = delete;
+        scope& operator=(scope const&) = delete;
+
+      public:
+        explicit scope(std::shared_ptr<rope_arena> const& arena):
+          m_previous(current_slot())
+        {
+          current_slot() = arena;
+        }
+
+        ~scope() { current_slot() = m_previous; }
+    };
 };
 
-template<class TString>
-class text_object {
+template<class T>
+class arena_allocator {
   private:
-    text_iterator<TString> create_iterator(typename TString::size_type i) const {
-      return text_iterator<TString>(this, i);
-    }
+    std::shared_ptr<rope_arena> m_arena;
 
-  protected:
-    rope<TString> const m_rope;
+  public:
+    typedef T value_type;
 
-    text_object(rope<TString> const& rope): m_rope(rope) {}
+    explicit arena_allocator(std::shared_ptr<rope_arena> const& arena): m_arena(arena) {}
 
-  public:
-    typedef text_iterator<TString> iterator;
+    template<class U>
+    arena_allocator(arena_allocator<U> const& a): m_arena(a.arena()) {}
 
-    rope<TString> const& get_rope() const { return m_rope; }
+    std::shared_ptr<rope_arena> const& arena() const { return m_arena; }
 
-    typename TString::size_type length() const {
-      auto it = m_rope.end();
+    T* allocate(std::size_t n) { return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T* p, std::size_t n) { m_arena->deallocate(p, n * sizeof(T)); }
 
-      if (it == m_rope.begin()) return 0;
+    template<class U>
+    bool operator==(arena_allocator<U> const& a) const { return m_arena == a.arena(); }
 
-      --it;
+    template<class U>
+    bool operator!=(arena_allocator<U> const& a) const { return m_arena != a.arena(); }
+};
 
-      return it->first;
+//  Counters of the work done on ropes, for telling why editing gets slow.
+//  They exist only when TXED_STATS is defined; otherwise neither the
+//  counters nor the code that updates them is compiled, so they cost
+//  nothing. The per-text counters are returned by text_object::stats().
+#ifdef TXED_STATS
+#define TXED_STATS_ONLY(...) __VA_ARGS__
+#else
+#define TXED_STATS_ONLY(...)
+#endif
+
+#ifdef TXED_STATS
+class rope_stats {
+  private:
+    static std::uint64_t& thread_nodes_created() {
+      static thread_local std::uint64_t n = 0;
+      return n;
     }
 
-    iterator begin()   const { return create_iterator(       0); }
-    iterator end()     const { return create_iterator(length()); }
-    iterator cbegin()  const { return begin(); }
-    iterator cend()    const { return end();   }
+  public:
+    // rope nodes made so far, and those still in use
+    std::atomic<std::uint64_t> nodes_created;
+    std::atomic<std::int64_t> nodes_alive;
+    // offset lookups in the rope made by text_object::at and by iterators
+    std::atomic<std::uint64_t> lookups;
+    // characters held by the leaf texts still in use, whether referenced or not
+    std::atomic<std::int64_t> source_length;
+
+    rope_stats(): nodes_created(0), nodes_alive(0), lookups(0), source_length(0) {}
+
+    static rope_stats& global() {
+      static rope_stats stats;
+      return stats;
+    }
 
-    typename TString::const_reference at(typename TString::size_type i) const {
-      auto segment_it = m_rope.upper_bound(i);
+    static void node_created() {
+      global().nodes_created.fetch_add(1, std::memory_order_relaxed);
+      global().nodes_alive.fetch_add(1, std::memory_order_relaxed);
+      ++thread_nodes_created();
+    }
 
-      if (segment_it == m_rope.end())
-      {
-        throw text_out_of_range(i, length());
-      }
+    static void node_destroyed() { global().nodes_alive.fetch_sub(1, std::memory_order_relaxed); }
 
-      auto const& segment_end_offset = segment_it->first;
-      auto const& segment_end = segment_it->second.second;
+    // nodes made on this thread since the previous call
+    static std::uint64_t take_thread_nodes_created() {
+      auto const n = thread_nodes_created();
+      thread_nodes_created() = 0;
+      return n;
+    }
+};
 
-      auto atom_it = segment_end - (segment_end_offset - i);
+//  Counters of one text object.
+struct text_stats {
+  // segments and height of the rope
+  std::size_t segments;
+  int height;
+  // rope nodes made for building this text rather than shared with its base
+  std::uint64_t nodes_built;
+  // offset lookups made in the rope of this text
+  std::uint64_t lookups;
+  // decorators between this text and a leaf text
+  std::size_t depth;
+};
+#endif
+
+//  How a rope node keeps its segment: in general as the pair of iterators,
+//  and for strings whose iterators can be made from character pointers as
+//  a pointer and a 32-bit length, which makes the tree nodes smaller. The
+//  length fits, as no segment is longer than rope::max_segment_length.
+template<class TString, class = void>
+class segment_storage {
+  private:
+    string_segment<TString> m_segment;
 
-      return *atom_it;
-    }
+  public:
+    explicit segment_storage(string_segment<TString> const& s): m_segment(s) {}
 
-    TString to_string() const { return TString(cbegin(), cend()); }
+    string_segment<TString> get() const { return m_segment; }
 };
 
 template<class TString>
-class text_string : public text_object<TString> {
+class segment_storage<
+  TString,
+  typename std::enable_if<
+    std::is_pointer<typename TString::const_pointer>::value &&
+    std::is_constructible<typename TString::const_iterator, typename TString::const_pointer>::value
+  >::type
+> {
   private:
-    TString const m_value;
+    typename TString::const_pointer m_begin;
+    std::uint32_t m_length;
 
-    static rope<TString> string_to_rope(TString const& value) {
-      return value.cend() != value.cbegin()
-        ? rope<TString> {
-            std::make_pair(
-              value.length(),
-              string_segment<TString>(
-                value.cbegin(),
-                value.cend()
-              )
-            )
-          }
-        : rope<TString>();
-    }
+    typedef typename TString::const_iterator iterator;
 
   public:
-    text_string(TString const& value):
-      text_object<TString>(string_to_rope(value)),
-      m_value(value)
-    {}
+    explicit segment_storage(string_segment<TString> const& s):
+      m_begin(s.first != s.second ? std::addressof(*s.first) : nullptr),
+      m_length(static_cast<std::uint32_t>(s.second - s.first))
+    {
+      assert(static_cast<std::uint64_t>(s.second - s.first) <= UINT32_MAX);
+    }
+
+    string_segment<TString> get() const { return string_segment<TString>(iterator(m_begin), iterator(m_begin + m_length)); }
+};
+
+//  How code units of a width make up Unicode code points: UTF-8 for one
+//  byte, UTF-16 for two and UTF-32 for four. Each function gives what the
+//  unit adds to a count, so that a count of a range is the sum over its
+//  units and no unit has to be decoded together with its neighbours.
+template<std::size_t width>
+struct unicode_units;
+
+// a code point starts at every byte but a continuation byte, and takes
+// two UTF-16 units if it takes four bytes
+template<>
+struct unicode_units<1> {
+  static std::size_t code_points(std::uint8_t c) { return (c & 0xC0) != 0x80; }
+  static std::size_t utf16_units(std::uint8_t c) { return (c & 0xC0) != 0x80 ? 1 + (c >= 0xF0) : 0; }
+};
+
+// a low surrogate continues the code point started by the high one
+template<>
+struct unicode_units<2> {
+  static std::size_t code_points(std::uint16_t c) { return (c & 0xFC00) != 0xDC00; }
+  static std::size_t utf16_units(std::uint16_t) { return 1; }
 };
 
+template<>
+struct unicode_units<4> {
+  static std::size_t code_points(std::uint32_t) { return 1; }
+  static std::size_t utf16_units(std::uint32_t c) { return 1 + (c >= 0x10000); }
+};
+
+//  A rope node as seen from outside the tree: the offset at which the
+//  segment ends within the whole text, and the segment itself.
 template<class TString>
-class text_replacement : public text_object<TString>
-{
+using rope_node = std::pair<typename TString::size_type, string_segment<TString> >;
+
+//  Persistent balanced (AVL) tree of string segments. Each tree node
+//  holds one non-empty segment and the total length of its subtree, so
+//  an offset is located in O(log n). Tree nodes are immutable and shared:
+//  slicing and concatenation create O(log n) new nodes along the cut
+//  paths and reuse every other node of the source ropes, and copying a
+//  rope is O(1). Concatenation merges segments that meet at the seam
+//  when one ends exactly where the other begins in the same string.
+template<class TString>
+class rope {
+  friend class history_file<TString>;
+
+  public:
+    typedef typename TString::size_type size_type;
+    typedef typename TString::difference_type difference_type;
+
+    // leaf strings are cut into segments of at most this length, so that
+    // whatever is computed per segment stays bounded
+    static size_type const max_segment_length = 1 << 16;
+
   private:
-    text_object<TString> const* const m_base;
-    typename text_object<TString>::iterator const m_patch_begin;
-    typename text_object<TString>::iterator const m_postfix_begin;
-    typename TString::size_type const m_prefix_length;
-    typename TString::size_type const m_patch_length;
-    typename TString::size_type const m_length;
+    struct tree_node;
+    typedef std::shared_ptr<tree_node const> node_ptr;
+
+    static size_type const unknown = static_cast<size_type>(-1);
+    static std::uint32_t const unknown_in_segment = static_cast<std::uint32_t>(-1);
+
+    // what the counts kept in the tree count, see count_units()
+    enum metric { newlines_metric, code_points_metric, utf16_metric, metric_count };
+
+    // a segment together with the counts of its characters already known
+    struct segment_info {
+      string_segment<TString> segment;
+      size_type counts[metric_count];
+    };
+
+    // the segment is a base so that height can take the padding after a compact one
+    struct tree_node : segment_storage<TString> {
+      int const height;
+      node_ptr const left;
+      node_ptr const right;
+      size_type const length;
+      size_type const count;
+
+      // counts for the segment and for the whole subtree, computed on first
+      // use, as most ropes are never asked about lines or code points; the
+      // segment counts fit in 32 bits, as segments are short
+      mutable std::atomic<std::uint32_t> segment_counts[metric_count];
+      mutable std::atomic<size_type> counts[metric_count];
+
+      tree_node(node_ptr const& l, segment_info const& s, node_ptr const& r):
+        segment_storage<TString>(s.segment),
+        height(std::max(height_of(l), height_of(r)) + 1),
+        left(l),
+        right(r),
+        length(length_of(l) + segment_length(s.segment) + length_of(r)),
+        count(count_of(l) + 1 + count_of(r))
+      {
+        for (int m = 0; m < metric_count; ++m) {
+          auto const n = s.counts[m];
 
-    static rope<TString> make_rope(
-      text_object<TString> const* base,
-      typename TString::size_type cut_from,
-      typename TString::size_type cut_to,
-      text_object<TString> const* patch,
-      typename TString::size_type patch_from,
-      typename TString::size_type patch_to
-    ) {
-      assert(cut_from <= base->length());
-      assert(cut_to <= base->length());
-      assert(patch_from <= patch->length());
-      assert(patch_to <= patch->length());
+          segment_counts[m].store(n == unknown ? unknown_in_segment : static_cast<std::uint32_t>(n), std::memory_order_relaxed);
+          counts[m].store(sum_known(known_count(l, m), n, known_count(r, m)), std::memory_order_relaxed);
+        }
 
-      auto const& base_map = base->get_rope();
-      auto const& patch_map = patch->get_rope();
+        TXED_STATS_ONLY(rope_stats::node_created();)
+      }
 
-      auto const prefix_view = rope_trimmed_range<TString>(&base_map, 0, cut_from, 0);
-      auto const patch_view = rope_trimmed_range<TString>(&patch_map, patch_from, patch_to, cut_from);
-      auto const postfix_view = rope_trimmed_range<TString>(&base_map, cut_to, base->length(), cut_from + patch_to - patch_from);
+      TXED_STATS_ONLY(~tree_node() { rope_stats::node_destroyed(); })
 
-      auto const joined = boost::join(
-        prefix_view.range(),
-        boost::join(
-          patch_view.range(),
-          postfix_view.range()
-        )
-      );
+      string_segment<TString> segment() const { return this->get(); }
+
+      size_type known_segment_count(int m) const {
+        auto const n = segment_counts[m].load(std::memory_order_relaxed);
+        return n == unknown_in_segment ? unknown : n;
+      }
+
+      segment_info info() const {
+        segment_info result;
+        result.segment = segment();
+        for (int m = 0; m < metric_count; ++m) result.counts[m] = known_segment_count(m);
+        return result;
+      }
+    };
+
+    node_ptr m_root;
 
-      return rope<TString>(joined.begin(), joined.end());
+    explicit rope(node_ptr const& root): m_root(root) {}
+
+    static size_type segment_length(string_segment<TString> const& s) { return s.second - s.first; }
+    static size_type length_of(node_ptr const& t) { return t ? t->length : 0; }
+    static size_type count_of(node_ptr const& t) { return t ? t->count : 0; }
+    static int height_of(node_ptr const& t) { return t ? t->height : 0; }
+
+    static size_type sum_known(size_type a, size_type b, size_type c) {
+      return a == unknown || b == unknown || c == unknown ? unknown : a + b + c;
     }
 
-  public:
-    text_replacement(
-      text_object<TString> const* base,
-      typename text_object<TString>::iterator cut_from,
-      typename text_object<TString>::iterator cut_to,
-      text_object<TString> const* patch,
-      typename text_object<TString>::iterator patch_from,
-      typename text_object<TString>::iterator patch_to
-    ):
-      text_object<TString>(
-        make_rope(
-          base,
-          cut_from - base->begin(),
-          cut_to - base->begin(),
-          patch,
-          patch_from - patch->begin(),
-          patch_to - patch->begin()
-        )
-      ),
-      m_base(base),
-      m_patch_begin(patch_from),
-      m_postfix_begin(cut_to),
-      m_prefix_length(cut_from - base->begin()),
-      m_patch_length(patch_to - patch_from),
-      m_length(base->length() - (cut_to - cut_from) + (patch_to - patch_from))
-    {
+    typedef unicode_units<sizeof(typename TString::value_type)> units;
+
+    // what a character adds to a count: 1 for a newline; 1 for the first
+    // unit of a code point; the UTF-16 length of the code point for its
+    // first unit. Whichever character has the k-th of the units counted,
+    // i.e. the k-th newline or the start of the code point with the k-th
+    // code point or UTF-16 unit, is found by offset_of_unit(m, k)
+    static size_type unit_weight(int m, typename TString::value_type c) {
+      switch (m) {
+        case newlines_metric: return c == typename TString::value_type('\n');
+        case code_points_metric: return units::code_points(c);
+        default: return units::utf16_units(c);
+      }
     }
 
-    text_replacement(
-      text_object<TString> const* base,
-      typename TString::size_type cut_from,
-      typename TString::size_type cut_to,
-      text_object<TString> const* patch,
-      typename TString::size_type patch_from,
-      typename TString::size_type patch_to
-    ):
-      text_object<TString>(
-        make_rope(
-          base,
-          cut_from,
-          cut_to,
-          patch,
-          patch_from,
-          patch_to
-        )
-      ),
-      m_base(base),
-      m_patch_begin(patch->begin() + patch_from),
-      m_postfix_begin(base->cbegin() + cut_to),
-      m_prefix_length(cut_from),
-      m_patch_length(patch_to - patch_from),
-      m_length(base->length() - (cut_to - cut_from) + (patch_to - patch_from))
-    {}
-};
+    static size_type count_units(int m, typename TString::const_iterator first, typename TString::const_iterator last) {
+      if (m == newlines_metric) return std::count(first, last, typename TString::value_type('\n'));
 
-template<class TString> bool text_iterator<TString>::is_begin() const { return is_at(0); }
-template<class TString> bool text_iterator<TString>::is_end() const { return is_at(m_target->length()); }
-template<class TString> void text_iterator<TString>::move_to_begin() { move_to(0); }
-template<class TString> void text_iterator<TString>::move_to_end() { move_to(m_target->length()); }
+      size_type result = 0;
+      for (; first != last; ++first) result += unit_weight(m, *first);
+      return result;
+    }
 
-template<class TString>
-typename TString::const_reference text_iterator<TString>::operator*() const { return m_target->at(m_current_index); }
+    static size_type known_count(node_ptr const& t, int m) {
+      return t ? t->counts[m].load(std::memory_order_relaxed) : 0;
+    }
 
-};
+    static size_type segment_count_of(tree_node const* t, int m) {
+      auto n = t->known_segment_count(m);
+
+      if (n == unknown) {
+        n = count_units(m, t->segment().first, t->segment().second);
+        t->segment_counts[m].store(static_cast<std::uint32_t>(n), std::memory_order_relaxed);
+      }
+
+      return n;
+    }
+
+    // concurrent readers may compute the same value, which is harmless
+    static size_type count_of(tree_node const* t, int m) {
+      if (!t) return 0;
+
+      auto n = t->counts[m].load(std::memory_order_relaxed);
+
+      if (n == unknown) {
+        n = count_of(t->left.get(), m) + segment_count_of(t, m) + count_of(t->right.get(), m);
+        t->counts[m].store(n, std::memory_order_relaxed);
+      }
+
+      return n;
+    }
+
+    static segment_info unknown_info(string_segment<TString> const& s) {
+      segment_info result;
+      result.segment = s;
+      std::fill(result.counts, result.counts + metric_count, unknown);
+      return result;
+    }
+
+    static node_ptr make_node(node_ptr const& l, segment_info const& s, node_ptr const& r) {
+      auto const& arena = rope_arena::current();
+
+      return arena
+        ? node_ptr(std::allocate_shared<tree_node>(arena_allocator<tree_node>(arena), l, s, r))
+        : node_ptr(std::make_shared<tree_node>(l, s, r));
+    }
+
+    static node_ptr rotate_left(node_ptr const& t) {
+      auto const& r = t->right;
+      return make_node(make_node(t->left, t->info(), r->left), r->info(), r->right);
+    }
+
+    static node_ptr rotate_right(node_ptr const& t) {
+      auto const& l = t->left;
+      return make_node(l->left, l->info(), make_node(l->right, t->info(), t->right));
+    }
+
+    // l is taller than r by more than one level
+    static node_ptr join_right(node_ptr const& l, segment_info const& s, node_ptr const& r) {
+      auto const& c = l->right;
+
+      if (height_of(c) <= height_of(r) + 1) {
+        auto const t = make_node(c, s, r);
+
+        return height_of(t) <= height_of(l->left) + 1
+          ? make_node(l->left, l->info(), t)
+          : rotate_left(make_node(l->left, l->info(), rotate_right(t)));
+      }
+
+      auto const t = join_right(c, s, r);
+      auto const u = make_node(l->left, l->info(), t);
+
+      return height_of(t) <= height_of(l->left) + 1 ? u : rotate_left(u);
+    }
+
+    // r is taller than l by more than one level
+    static node_ptr join_left(node_ptr const& l, segment_info const& s, node_ptr const& r) {
+      auto const& c = r->left;
+
+      if (height_of(c) <= height_of(l) + 1) {
+        auto const t = make_node(l, s, c);
+
+        return height_of(t) <= height_of(r->right) + 1
+          ? make_node(t, r->info(), r->right)
+          : rotate_right(make_node(rotate_left(t), r->info(), r->right));
+      }
+
+      auto const t = join_left(l, s, c);
+      auto const u = make_node(t, r->info(), r->right);
+
+      return height_of(t) <= height_of(r->right) + 1 ? u : rotate_right(u);
+    }
+
+    // all of l, then s, then all of r; s must not be empty
+    static node_ptr join(node_ptr const& l, segment_info const& s, node_ptr const& r) {
+      if (height_of(l) > height_of(r) + 1) return join_right(l, s, r);
+      if (height_of(r) > height_of(l) + 1) return join_left(l, s, r);
+      return make_node(l, s, r);
+    }
+
+    static std::pair<node_ptr, segment_info> split_last(node_ptr const& t) {
+      if (!t->right) return std::make_pair(t->left, t->info());
+
+      auto const rest = split_last(t->right);
+
+      return std::make_pair(join(t->left, t->info(), rest.first), rest.second);
+    }
+
+    static std::pair<segment_info, node_ptr> split_first(node_ptr const& t) {
+      if (!t->left) return std::make_pair(t->info(), t->right);
+
+      auto const rest = split_first(t->left);
+
+      return std::make_pair(rest.first, join(rest.second, t->info(), t->right));
+    }
+
+    static string_segment<TString> first_segment(tree_node const* t) {
+      for (; t->left; t = t->left.get()) {}
+      return t->segment();
+    }
+
+    // whether b starts right where a ends in the same string and both fit
+    // in one segment; a and b must not be empty
+    static bool mergeable(string_segment<TString> const& a, string_segment<TString> const& b) {
+      return segment_length(a) + segment_length(b) <= max_segment_length
+        && std::addressof(*(a.second - 1)) + 1 == std::addressof(*b.first);
+    }
+
+    static segment_info merge(segment_info const& a, segment_info const& b) {
+      segment_info result;
+      result.segment = string_segment<TString>(a.segment.first, b.segment.second);
+
+      for (int m = 0; m < metric_count; ++m) {
+        result.counts[m] = a.counts[m] == unknown || b.counts[m] == unknown ? unknown : a.counts[m] + b.counts[m];
+      }
+
+      return result;
+    }
+
+    // all of l, then all of r, merging the segments that meet at the seam if they are contiguous
+    static node_ptr join(node_ptr const& l, node_ptr const& r) {
+      if (!l) return r;
+      if (!r) return l;
+
+      auto const last = split_last(l);
+
+      if (mergeable(last.second.segment, first_segment(r.get()))) {
+        auto const first = split_first(r);
+        return join(last.first, merge(last.second, first.first), first.second);
+      }
+
+      return join(last.first, last.second, r);
+    }
+
+    // the two parts of a segment cut k characters from its beginning;
+    // where the count for the whole is known, only the shorter part is counted
+    static std::pair<segment_info, segment_info> cut(segment_info const& whole, size_type k) {
+      auto const& s = whole.segment;
+      auto const middle = s.first + k;
+
+      auto result = std::make_pair(
+        unknown_info(string_segment<TString>(s.first, middle)),
+        unknown_info(string_segment<TString>(middle, s.second))
+      );
+
+      for (int m = 0; m < metric_count; ++m) {
+        auto const total = whole.counts[m];
+
+        if (total == unknown) continue;
+
+        if (2 * k <= segment_length(s)) {
+          result.first.counts[m] = count_units(m, s.first, middle);
+          result.second.counts[m] = total - result.first.counts[m];
+        } else {
+          result.second.counts[m] = count_units(m, middle, s.second);
+          result.first.counts[m] = total - result.second.counts[m];
+        }
+      }
+
+      return result;
+    }
+
+    // first k characters of t, and the rest
+    static std::pair<node_ptr, node_ptr> split(node_ptr const& t, size_type k) {
+      if (!t) return std::make_pair(node_ptr(), node_ptr());
+
+      auto const left_length = length_of(t->left);
+      auto const right_begin = left_length + segment_length(t->segment());
+
+      if (k <= left_length) {
+        auto const sub = split(t->left, k);
+        return std::make_pair(sub.first, join(sub.second, t->info(), t->right));
+      }
+
+      if (k >= right_begin) {
+        auto const sub = split(t->right, k - right_begin);
+        return std::make_pair(join(t->left, t->info(), sub.first), sub.second);
+      }
+
+      auto const parts = cut(t->info(), k - left_length);
+
+      return std::make_pair(
+        join(t->left, parts.first, node_ptr()),
+        join(node_ptr(), parts.second, t->right)
+      );
+    }
+
+    static node_ptr build(segment_info const* first, segment_info const* last) {
+      if (first == last) return node_ptr();
+
+      auto const middle = first + (last - first) / 2;
+
+      return make_node(build(first, middle), *middle, build(middle + 1, last));
+    }
+
+    static void append_segment(std::vector<segment_info>& segments, segment_info const& s) {
+      if (!segments.empty() && mergeable(segments.back().segment, s.segment)) {
+        segments.back() = merge(segments.back(), s);
+      } else {
+        segments.push_back(s);
+      }
+    }
+
+    // appends the segments of [from, to) of t, with the counts known for them
+    static void collect(tree_node const* t, size_type from, size_type to, std::vector<segment_info>& segments) {
+      if (!t || from >= to) return;
+
+      auto const left_length = length_of(t->left);
+      auto const right_begin = left_length + segment_length(t->segment());
+
+      if (from < left_length) collect(t->left.get(), from, std::min(to, left_length), segments);
+
+      auto const begin = std::max(from, left_length);
+      auto const end = std::min(to, right_begin);
+
+      if (begin < end) {
+        auto s = t->info();
+
+        if (end < right_begin) s = cut(s, end - left_length).first;
+        if (begin > left_length) s = cut(s, begin - left_length).second;
+
+        append_segment(segments, s);
+      }
+
+      if (to > right_begin) collect(t->right.get(), from > right_begin ? from - right_begin : 0, to - right_begin, segments);
+    }
+
+  public:
+    class const_iterator:
+      public boost::forward_iterator_helper<
+        const_iterator,
+        rope_node<TString> const,
+        difference_type,
+        rope_node<TString> const*,
+        rope_node<TString> const&
+      >
+    {
+      friend class rope<TString>;
+
+      private:
+        // nodes whose segments are still to be visited, current one on top
+        std::vector<tree_node const*> m_path;
+        rope_node<TString> m_current;
+
+        void push_left_spine(tree_node const* t) {
+          for (; t; t = t->left.get()) m_path.push_back(t);
+        }
+
+        void settle(size_type begin_offset) {
+          if (m_path.empty()) return;
+
+          auto const& s = m_path.back()->segment();
+          m_current = rope_node<TString>(begin_offset + segment_length(s), s);
+        }
+
+      public:
+        const_iterator() {}
+
+        rope_node<TString> const& operator*() const { return m_current; }
+
+        const_iterator& operator++() {
+          auto const t = m_path.back();
+          m_path.pop_back();
+          push_left_spine(t->right.get());
+          settle(m_current.first);
+          return *this;
+        }
+
+        // by position, as a node shared by several parts of the rope is at several
+        bool operator==(const_iterator const& it) const {
+          return m_path.empty()
+            ? it.m_path.empty()
+            : !it.m_path.empty() && m_current.first == it.m_current.first;
+        }
+    };
+
+    typedef const_iterator iterator;
+    typedef rope_node<TString> value_type;
+
+    rope() {}
+
+    explicit rope(string_segment<TString> const& segment) {
+      std::vector<segment_info> segments;
+
+      for (auto it = segment.first; it != segment.second; ) {
+        auto const next = it + std::min<size_type>(max_segment_length, segment.second - it);
+        segments.push_back(unknown_info(string_segment<TString>(it, next)));
+        it = next;
+      }
+
+      m_root = build(segments.data(), segments.data() + segments.size());
+    }
+
+    // [from, to) of a rope, as a part of the rope assembled by assemble()
+    struct piece {
+      rope const* source;
+      size_type from;
+      size_type to;
+    };
+
+    // the pieces one after another as one new rope, built in a single pass
+    // over their segments, without the nodes along the cut paths that
+    // slicing and concatenating them make; cheaper when the pieces are many
+    // and their segments few. Counts already known are kept
+    static rope assemble(std::vector<piece> const& pieces) {
+      std::vector<segment_info> segments;
+
+      for (auto const& p : pieces) {
+        assert(p.from <= p.to && p.to <= p.source->length());
+        collect(p.source->m_root.get(), p.from, p.to, segments);
+      }
+
+      return rope(build(segments.data(), segments.data() + segments.size()));
+    }
+
+    size_type length() const { return length_of(m_root); }
+    size_type size() const { return count_of(m_root); }
+    bool empty() const { return !m_root; }
+    int height() const { return height_of(m_root); }
+
+    const_iterator begin() const {
+      const_iterator it;
+      it.push_left_spine(m_root.get());
+      it.settle(0);
+      return it;
+    }
+
+    const_iterator end() const { return const_iterator(); }
+
+    // the node whose segment contains the given offset, as with std::map::upper_bound
+    const_iterator upper_bound(size_type offset) const {
+      const_iterator it;
+      size_type begin_offset = 0;
+
+      for (auto t = m_root.get(); t; ) {
+        auto const left_length = length_of(t->left);
+        auto const right_begin = left_length + segment_length(t->segment());
+
+        if (offset < left_length) {
+          it.m_path.push_back(t);
+          t = t->left.get();
+        } else if (offset < right_begin) {
+          it.m_path.push_back(t);
+          it.settle(begin_offset + left_length);
+          break;
+        } else {
+          offset -= right_begin;
+          begin_offset += right_begin;
+          t = t->right.get();
+        }
+      }
+
+      return it;
+    }
+
+    // the segment containing the given offset and its end offset; requires offset < length()
+    rope_node<TString> segment_at(size_type offset) const {
+      assert(offset < length());
+
+      size_type begin_offset = 0;
+      auto t = m_root.get();
+
+      for (;;) {
+        auto const left_length = length_of(t->left);
+        auto const right_begin = left_length + segment_length(t->segment());
+
+        if (offset < left_length) {
+          t = t->left.get();
+        } else if (offset < right_begin) {
+          return rope_node<TString>(begin_offset + right_begin, t->segment());
+        } else {
+          offset -= right_begin;
+          begin_offset += right_begin;
+          t = t->right.get();
+        }
+      }
+    }
+
+    rope slice(size_type from, size_type to) const {
+      assert(from <= to);
+      assert(to <= length());
+
+      if (from == to) return rope();
+
+      auto const head = to == length() ? m_root : split(m_root, to).first;
+
+      return rope(from == 0 ? head : split(head, from).second);
+    }
+
+    // this rope with [from, to) replaced by patch; an insertion splits the tree only once
+    rope replace(size_type from, size_type to, rope const& patch) const {
+      assert(from <= to);
+      assert(to <= length());
+
+      if (from == to) {
+        auto const parts = split(m_root, from);
+        return rope(join(join(parts.first, patch.m_root), parts.second));
+      }
+
+      return rope(join(join(split(m_root, from).first, patch.m_root), split(m_root, to).second));
+    }
+
+    static rope concat(rope const& x, rope const& y) { return rope(join(x.m_root, y.m_root)); }
+
+  private:
+    // units of metric m in the first offset characters; requires offset <= length()
+    size_type count_before(int m, size_type offset) const {
+      assert(offset <= length());
+
+      size_type result = 0;
+
+      for (auto t = m_root.get(); t; ) {
+        auto const left_length = length_of(t->left);
+        auto const right_begin = left_length + segment_length(t->segment());
+
+        if (offset <= left_length) {
+          t = t->left.get();
+        } else if (offset < right_begin) {
+          return result + count_of(t->left.get(), m) + count_units(m, t->segment().first, t->segment().first + (offset - left_length));
+        } else {
+          result += count_of(t->left.get(), m) + segment_count_of(t, m);
+          offset -= right_begin;
+          t = t->right.get();
+        }
+      }
+
+      return result;
+    }
+
+    // offset of the character with the k-th unit of metric m, counting
+    // from 0; requires k < count_of(m_root, m)
+    size_type offset_of_unit(int m, size_type k) const {
+      assert(k < count_of(m_root.get(), m));
+
+      size_type begin_offset = 0;
+      auto t = m_root.get();
+
+      for (;;) {
+        auto const left_count = count_of(t->left.get(), m);
+
+        if (k < left_count) {
+          t = t->left.get();
+          continue;
+        }
+
+        k -= left_count;
+
+        auto const left_length = length_of(t->left);
+        auto const own_count = segment_count_of(t, m);
+
+        if (k < own_count) {
+          auto it = t->segment().first;
+
+          for (;; ++it) {
+            auto const w = unit_weight(m, *it);
+            if (k < w) break;
+            k -= w;
+          }
+
+          return begin_offset + left_length + (it - t->segment().first);
+        }
+
+        k -= own_count;
+        begin_offset += left_length + segment_length(t->segment());
+        t = t->right.get();
+      }
+    }
+
+  public:
+    size_type newlines() const { return count_of(m_root.get(), newlines_metric); }
+
+    // number of newlines in the first offset characters; requires offset <= length()
+    size_type newlines_before(size_type offset) const { return count_before(newlines_metric, offset); }
+
+    // offset of the k-th newline, counting from 0; requires k < newlines()
+    size_type offset_of_newline(size_type k) const { return offset_of_unit(newlines_metric, k); }
+
+    // the same for code points, of which the k-th is found at the offset of its first unit
+    size_type code_points() const { return count_of(m_root.get(), code_points_metric); }
+    size_type code_points_before(size_type offset) const { return count_before(code_points_metric, offset); }
+    size_type offset_of_code_point(size_type k) const { return offset_of_unit(code_points_metric, k); }
+
+    // and for the UTF-16 units the code points would take, of which the
+    // k-th is found at the first unit of the code point it is part of
+    size_type utf16_units() const { return count_of(m_root.get(), utf16_metric); }
+    size_type utf16_units_before(size_type offset) const { return count_before(utf16_metric, offset); }
+    size_type offset_of_utf16_unit(size_type k) const { return offset_of_unit(utf16_metric, k); }
+
+    // concatenates a sequence of ropes pairwise, so that small pieces are joined with small ones
+    template<class TIterator>
+    static rope concat_all(TIterator first, TIterator last) {
+      auto const count = std::distance(first, last);
+
+      if (count == 0) return rope();
+      if (count == 1) return *first;
+
+      auto const middle = std::next(first, count / 2);
+
+      return concat(concat_all(first, middle), concat_all(middle, last));
+    }
+};
+
+template<class TString>
+class rope_node_trimmer {
+  private:
+    typename TString::size_type m_new_begin_offset;
+    typename TString::size_type m_new_end_offset;
+    typename TString::difference_type m_shift;
+
+  public:
+    rope_node_trimmer(
+      typename TString::size_type new_begin_offset,
+      typename TString::size_type new_end_offset,
+      typename TString::difference_type shift
+    ):
+      m_new_begin_offset(new_begin_offset),
+      m_new_end_offset(new_end_offset),
+      m_shift(shift)
+    {}
+
+    typename TString::size_type new_begin_offset() const { return m_new_begin_offset; }
+    typename TString::size_type new_end_offset() const { return m_new_end_offset; }
+    typename TString::difference_type shift() const { return m_shift; }
+
+    rope_node<TString> operator()(rope_node<TString> const& x) const {
+      auto const& end_offset = x.first;
+      auto const& begin = x.second.first;
+      auto const& end = x.second.second;
+      auto const length = end - begin;
+      auto const begin_offset = end_offset - length;
+
+      assert(end_offset >= m_new_begin_offset);
+      assert(begin_offset <= m_new_end_offset);
+
+      auto const begin_shift = std::max<typename TString::difference_type>(0, m_new_begin_offset - begin_offset);
+      auto const end_shift = std::min<typename TString::difference_type>(0, m_new_end_offset - end_offset);
+      auto const new_begin = begin + begin_shift;
+      auto const new_end = end + end_shift;
+      auto const new_end_offset = end_offset - m_new_begin_offset + end_shift + m_shift;
+
+      return rope_node<TString>(new_end_offset, string_segment<TString>(new_begin, new_end));
+    }
+};
+
+template<class TString>
+class rope_trimmed_range {
+  public:
+    typedef
+      boost::transform_iterator<
+        rope_node_trimmer<TString>,
+        typename rope<TString>::const_iterator
+      >
+      iterator;
+
+  private:
+    rope<TString> const* const m_base;
+    rope_node_trimmer<TString> m_trimmer;
+
+    iterator make_iterator(typename rope<TString>::const_iterator const& it) const {
+      return boost::make_transform_iterator(it, m_trimmer);
+    }
+
+  public:
+    rope_trimmed_range(
+      rope<TString> const* base, 
+      typename TString::size_type begin,
+      typename TString::size_type end,
+      typename TString::difference_type shift
+    ):
+      m_base(base),
+      m_trimmer(begin, end, shift)
+    {}
+
+    iterator begin() const { return make_iterator(m_base->upper_bound(m_trimmer.new_begin_offset())); }
+
+    // past the node holding the last character, so that no empty node trails the range
+    iterator end() const {
+      if (m_trimmer.new_end_offset() <= m_trimmer.new_begin_offset()) return begin();
+
+      auto it = m_base->upper_bound(m_trimmer.new_end_offset() - 1);
+
+      if (it != m_base->end()) {
+        ++it;
+      }
+
+      return make_iterator(it);
+    }
+
+    std::pair<iterator, iterator> range() const { return std::make_pair(begin(), end()); }
+};
+
+//  Contiguous block of characters: pointer to the first one and length.
+//  Only meaningful when TString keeps its characters contiguously.
+template<class TString>
+using text_span = std::pair<typename TString::const_pointer, typename TString::size_type>;
+
+template<class TString>
+class rope_node_span {
+  public:
+    text_span<TString> operator()(rope_node<TString> const& x) const {
+      auto const& begin = x.second.first;
+      auto const& end = x.second.second;
+
+      return begin != end
+        ? text_span<TString>(std::addressof(*begin), end - begin)
+        : text_span<TString>(nullptr, 0);
+    }
+};
+
+template<class TString>
+class text_object {
+  private:
+    text_iterator<TString> create_iterator(typename TString::size_type i) const {
+      return text_iterator<TString>(this, i);
+    }
+
+    // built on first use in lazy text objects, see text_lazy_replacement
+    mutable rope<TString> m_rope;
+    typename TString::size_type const m_length;
+    mutable std::atomic<bool> m_ready;
+    mutable std::once_flag m_build_once;
+
+#ifdef TXED_STATS
+    friend class text_iterator<TString>;
+
+    mutable std::uint64_t m_nodes_built;
+    mutable std::atomic<std::uint64_t> m_lookups;
+    std::size_t m_depth;
+
+    void count_lookup() const {
+      m_lookups.fetch_add(1, std::memory_order_relaxed);
+      rope_stats::global().lookups.fetch_add(1, std::memory_order_relaxed);
+    }
+#endif
+
+  protected:
+    // the rope is taken as built just before, so the nodes made on this
+    // thread since the previous text object are counted as its own
+    text_object(rope<TString> const& rope):
+      m_rope(rope),
+      m_length(rope.length()),
+      m_ready(true)
+      TXED_STATS_ONLY(, m_nodes_built(rope_stats::take_thread_nodes_created()), m_lookups(0), m_depth(0))
+    {}
+
+    text_object(text_object const& x):
+      m_rope(x.get_rope()),
+      m_length(x.m_length),
+      m_ready(true)
+      TXED_STATS_ONLY(, m_nodes_built(0), m_lookups(0), m_depth(x.m_depth))
+    {}
+
+    // for lazy text objects, whose rope is built by build_rope() when first needed
+    explicit text_object(typename TString::size_type length):
+      m_length(length),
+      m_ready(false)
+      TXED_STATS_ONLY(, m_nodes_built(0), m_lookups(0), m_depth(0))
+    {}
+
+    virtual rope<TString> build_rope() const { return m_rope; }
+
+    // to be called by the constructor of a text object decorating base
+    void decorates(text_object const& base) {
+      TXED_STATS_ONLY(m_depth = base.m_depth + 1;)
+      (void)base;
+    }
+
+  public:
+    virtual ~text_object() {}
+
+    // whether the rope is there already; false only for lazy text objects not yet read
+    bool is_built() const { return m_ready.load(std::memory_order_acquire); }
+
+#ifdef TXED_STATS
+    // builds the rope of a lazy text object
+    text_stats stats() const {
+      auto const& r = get_rope();
+      return text_stats { r.size(), r.height(), m_nodes_built, m_lookups.load(std::memory_order_relaxed), m_depth };
+    }
+#endif
+
+    typedef text_iterator<TString> iterator;
+
+    typedef
+      boost::transform_iterator<
+        rope_node_span<TString>,
+        typename rope_trimmed_range<TString>::iterator
+      >
+      span_iterator;
+
+    typedef boost::iterator_range<span_iterator> span_range;
+
+    rope<TString> const& get_rope() const {
+      if (!m_ready.load(std::memory_order_acquire)) {
+        std::call_once(m_build_once, [this]() {
+          TXED_STATS_ONLY(rope_stats::take_thread_nodes_created();)
+          m_rope = build_rope();
+          TXED_STATS_ONLY(m_nodes_built = rope_stats::take_thread_nodes_created();)
+          m_ready.store(true, std::memory_order_release);
+        });
+      }
+
+      return m_rope;
+    }
+
+    typename TString::size_type length() const { return m_length; }
+
+    iterator begin()   const { return create_iterator(       0); }
+    iterator end()     const { return create_iterator(length()); }
+    iterator cbegin()  const { return begin(); }
+    iterator cend()    const { return end();   }
+
+    typename TString::const_reference at(typename TString::size_type i) const {
+      if (i >= length())
+      {
+        throw text_out_of_range(i, length());
+      }
+
+      TXED_STATS_ONLY(count_lookup();)
+
+      auto const segment_node = get_rope().segment_at(i);
+      auto const& segment_end_offset = segment_node.first;
+      auto const& segment_end = segment_node.second.second;
+
+      auto atom_it = segment_end - (segment_end_offset - i);
+
+      return *atom_it;
+    }
+
+    TString to_string() const {
+      TString result;
+      result.reserve(length());
+
+      for (auto const& node : get_rope()) {
+        result.append(node.second.first, node.second.second);
+      }
+
+      return result;
+    }
+
+    // copies the characters in [from, to) to out segment by segment;
+    // returns the position past the last character written
+    typename TString::value_type* copy_to(
+      typename TString::value_type* out,
+      typename TString::size_type from,
+      typename TString::size_type to
+    ) const {
+      if (from > to || to > length())
+      {
+        throw text_out_of_range(to, length());
+      }
+
+      auto const view = rope_trimmed_range<TString>(&get_rope(), from, to, 0);
+      auto const last = view.end();
+
+      for (auto it = view.begin(); it != last; ++it) {
+        rope_node<TString> const node = *it;
+        out = std::copy(node.second.first, node.second.second, out);
+      }
+
+      return out;
+    }
+
+    typename TString::value_type* copy_to(typename TString::value_type* out) const {
+      return copy_to(out, 0, length());
+    }
+
+    // the characters in [from, to) as spans pointing directly into the
+    // source strings, e.g. to fill an iovec array; valid while this object lives
+    span_range spans(typename TString::size_type from, typename TString::size_type to) const {
+      if (from > to || to > length())
+      {
+        throw text_out_of_range(to, length());
+      }
+
+      auto const view = rope_trimmed_range<TString>(&get_rope(), from, to, 0);
+
+      return boost::make_iterator_range(
+        boost::make_transform_iterator(view.begin(), rope_node_span<TString>()),
+        boost::make_transform_iterator(view.end(), rope_node_span<TString>())
+      );
+    }
+
+    span_range spans() const { return spans(0, length()); }
+
+    // lines are separated by newline characters and numbered from 0;
+    // a text ending with a newline has an empty last line
+    typename TString::size_type line_count() const { return get_rope().newlines() + 1; }
+
+    // the line containing the character at the given offset
+    typename TString::size_type line_of(typename TString::size_type offset) const {
+      if (offset > length())
+      {
+        throw text_out_of_range(offset, length());
+      }
+
+      return get_rope().newlines_before(offset);
+    }
+
+    typename TString::size_type offset_of_line(typename TString::size_type k) const {
+      if (k >= line_count())
+      {
+        throw line_out_of_range();
+      }
+
+      return k == 0 ? 0 : get_rope().offset_of_newline(k - 1) + 1;
+    }
+
+    // [begin, end) of the line, without its newline
+    std::pair<typename TString::size_type, typename TString::size_type> line_range(typename TString::size_type k) const {
+      auto const begin = offset_of_line(k);
+      auto const end = k + 1 < line_count() ? get_rope().offset_of_newline(k) : length();
+
+      return std::make_pair(begin, end);
+    }
+
+    // positions as counted in Unicode code points and in UTF-16 units, as
+    // language servers count them, for the encoding that the width of the
+    // character type implies: UTF-8, UTF-16 or UTF-32. All conversions take
+    // O(log n) once the counts are cached in the rope
+    typename TString::size_type code_point_count() const { return get_rope().code_points(); }
+    typename TString::size_type utf16_length() const { return get_rope().utf16_units(); }
+
+    // code points, or UTF-16 units, in the first offset characters
+    typename TString::size_type code_point_offset(typename TString::size_type offset) const {
+      if (offset > length())
+      {
+        throw text_out_of_range(offset, length());
+      }
+
+      return get_rope().code_points_before(offset);
+    }
+
+    typename TString::size_type utf16_offset(typename TString::size_type offset) const {
+      if (offset > length())
+      {
+        throw text_out_of_range(offset, length());
+      }
+
+      return get_rope().utf16_units_before(offset);
+    }
+
+    // offset at which the k-th code point starts, or the one that the
+    // k-th UTF-16 unit is part of; for k at the end, the length
+    typename TString::size_type offset_of_code_point(typename TString::size_type k) const {
+      auto const n = code_point_count();
+
+      if (k > n)
+      {
+        throw text_out_of_range(k, n);
+      }
+
+      return k == n ? length() : get_rope().offset_of_code_point(k);
+    }
+
+    typename TString::size_type offset_of_utf16(typename TString::size_type k) const {
+      auto const n = utf16_length();
+
+      if (k > n)
+      {
+        throw text_out_of_range(k, n);
+      }
+
+      return k == n ? length() : get_rope().offset_of_utf16_unit(k);
+    }
+
+    // calls visit(offset) for every match of needle starting in [from, to),
+    // left to right and without overlaps, until visit returns false. Each
+    // segment is scanned for the first character with traits_type::find
+    // (memchr for char), and only the candidates are verified, across
+    // segment boundaries when a candidate is close to the end of one
+    template<class TVisitor>
+    void scan(
+      TString const& needle,
+      typename TString::size_type from,
+      typename TString::size_type to,
+      TVisitor visit
+    ) const {
+      typedef typename TString::traits_type traits;
+
+      auto const m = needle.length();
+
+      if (from > to || to > length())
+      {
+        throw text_out_of_range(to, length());
+      }
+
+      if (m == 0 || m > length()) return;
+
+      auto const last_start = length() - m;
+      auto const view = rope_trimmed_range<TString>(&get_rope(), from, to, from);
+      auto const last = view.end();
+      auto resume = from;
+
+      for (auto it = view.begin(); it != last; ++it) {
+        rope_node<TString> const node = *it;
+        auto const& segment = node.second;
+        auto const n = static_cast<typename TString::size_type>(segment.second - segment.first);
+
+        if (n == 0 || resume >= node.first) continue;
+
+        auto const segment_begin = node.first - n;
+        auto const p = std::addressof(*segment.first);
+        auto i = resume > segment_begin ? resume - segment_begin : 0;
+
+        while (i < n) {
+          auto const q = traits::find(p + i, n - i, needle[0]);
+
+          if (!q) break;
+
+          auto const k = static_cast<typename TString::size_type>(q - p);
+          auto const offset = segment_begin + k;
+
+          if (offset > last_start) return;
+
+          auto const found = k + m <= n
+            ? traits::compare(q, needle.data(), m) == 0
+            : std::equal(needle.begin(), needle.end(), begin() + offset);
+
+          if (found) {
+            if (!visit(offset)) return;
+            resume = offset + m;
+            i = k + m;
+          } else {
+            i = k + 1;
+          }
+        }
+      }
+    }
+
+    // flat read-only copy of the rope for fast random access
+    frozen_text<TString> freeze() const;
+
+    // offset of the first match of needle at or after from, or TString::npos
+    typename TString::size_type find(TString const& needle, typename TString::size_type from = 0) const {
+      if (from > length()) return TString::npos;
+      if (needle.empty()) return from;
+
+      auto result = TString::npos;
+
+      scan(needle, from, length(), [&result](typename TString::size_type offset) {
+        result = offset;
+        return false;
+      });
+
+      return result;
+    }
+
+    // offsets of all non-overlapping matches of needle, in order
+    std::vector<typename TString::size_type> find_all(TString const& needle) const {
+      std::vector<typename TString::size_type> result;
+
+      scan(needle, 0, length(), [&result](typename TString::size_type offset) {
+        result.push_back(offset);
+        return true;
+      });
+
+      return result;
+    }
+};
+
+template<class TString>
+class text_string : public text_object<TString> {
+  private:
+    // held by pointer so that the rope can be built on the very string
+    // that is kept, before the member itself is initialised
+    std::unique_ptr<TString const> const m_value;
+
+    static rope<TString> string_to_rope(TString const& value) {
+      return rope<TString>(string_segment<TString>(value.cbegin(), value.cend()));
+    }
+
+    text_string(std::unique_ptr<TString const> value):
+      text_object<TString>(string_to_rope(*value)),
+      m_value(std::move(value))
+    {
+      TXED_STATS_ONLY(rope_stats::global().source_length += m_value->length();)
+    }
+
+  public:
+    text_string(TString const& value):
+      text_string(std::unique_ptr<TString const>(new TString(value)))
+    {}
+
+    TXED_STATS_ONLY(~text_string() { rope_stats::global().source_length -= m_value->length(); })
+};
+
+//  Builds a text from input that arrives piece by piece and cannot be
+//  mapped, such as a pipe or a network stream. Each chunk appended is kept
+//  in a string of its own and added to the rope as it comes, so the text
+//  read so far can be taken at any time, e.g. for rendering before the
+//  load is complete. A text once taken never changes; one taken later has
+//  more chunks. Chunks may be appended on one thread while the text is
+//  taken on others.
+template<class TString>
+class text_stream_builder {
+  private:
+    // each chunk keeps the ones before it, so a text holds all of its chunks through the last one
+    struct chunk {
+      // only ever reset, by the destructor of the chunk after it
+      mutable std::shared_ptr<chunk const> previous;
+      TString const value;
+
+      chunk(std::shared_ptr<chunk const> const& p, TString&& v):
+        previous(p),
+        value(std::move(v))
+      {
+        TXED_STATS_ONLY(rope_stats::global().source_length += value.length();)
+      }
+
+      // unlinked one by one, as releasing a long chain recursively would overflow the stack
+      ~chunk() {
+        TXED_STATS_ONLY(rope_stats::global().source_length -= value.length();)
+
+        for (auto next = std::move(previous); next && next.use_count() == 1; ) next = std::move(next->previous);
+      }
+    };
+
+    class prefix : public text_object<TString> {
+      private:
+        std::shared_ptr<chunk const> const m_last;
+
+      public:
+        prefix(rope<TString> const& r, std::shared_ptr<chunk const> const& last):
+          text_object<TString>(r),
+          m_last(last)
+        {}
+    };
+
+    typename TString::size_type const m_chunk_length;
+
+    mutable std::mutex m_mutex;
+    std::shared_ptr<chunk const> m_last;
+    rope<TString> m_rope;
+    // the text last taken, given out again while no chunk has been added
+    mutable std::shared_ptr<text_object<TString> const> m_text;
+
+  public:
+    static typename TString::size_type const default_chunk_length = 1 << 16;
+
+    explicit text_stream_builder(typename TString::size_type chunk_length = default_chunk_length):
+      m_chunk_length(chunk_length)
+    {}
+
+    void append(TString value) {
+      if (value.empty()) return;
+
+      std::lock_guard<std::mutex> const lock(m_mutex);
+
+      m_last = std::make_shared<chunk const>(m_last, std::move(value));
+      m_rope = rope<TString>::concat(m_rope, rope<TString>(string_segment<TString>(m_last->value.cbegin(), m_last->value.cend())));
+    }
+
+    // appends up to chunk_length characters read from in; returns false
+    // once the input is exhausted. Read errors are reported by the stream
+    template<class TStream>
+    bool read(TStream& in) {
+      TString buffer(m_chunk_length, typename TString::value_type());
+
+      in.read(&buffer[0], m_chunk_length);
+      buffer.resize(in.gcount());
+      append(std::move(buffer));
+
+      return static_cast<bool>(in);
+    }
+
+    template<class TStream>
+    void read_all(TStream& in) {
+      while (read(in)) {}
+    }
+
+    typename TString::size_type length() const {
+      std::lock_guard<std::mutex> const lock(m_mutex);
+      return m_rope.length();
+    }
+
+    // the text appended so far
+    std::shared_ptr<text_object<TString> const> text() const {
+      std::lock_guard<std::mutex> const lock(m_mutex);
+
+      if (!m_text || m_text->length() != m_rope.length()) {
+        m_text = std::make_shared<prefix const>(m_rope, m_last);
+      }
+
+      return m_text;
+    }
+};
+
+template<class TString>
+class text_replacement : public text_object<TString>
+{
+  private:
+    text_object<TString> const* const m_base;
+    typename text_object<TString>::iterator const m_patch_begin;
+    typename text_object<TString>::iterator const m_postfix_begin;
+    typename TString::size_type const m_prefix_length;
+    typename TString::size_type const m_patch_length;
+    typename TString::size_type const m_length;
+
+    static rope<TString> make_rope(
+      text_object<TString> const* base,
+      typename TString::size_type cut_from,
+      typename TString::size_type cut_to,
+      text_object<TString> const* patch,
+      typename TString::size_type patch_from,
+      typename TString::size_type patch_to
+    ) {
+      assert(cut_from <= base->length());
+      assert(cut_to <= base->length());
+      assert(patch_from <= patch->length());
+      assert(patch_to <= patch->length());
+
+      auto const& base_rope = base->get_rope();
+      auto const& patch_rope = patch->get_rope();
+
+      // only the nodes on the cut paths are rebuilt, the rest is shared with base and patch
+      return base_rope.replace(cut_from, cut_to, patch_rope.slice(patch_from, patch_to));
+    }
+
+  public:
+    text_replacement(
+      text_object<TString> const* base,
+      typename text_object<TString>::iterator cut_from,
+      typename text_object<TString>::iterator cut_to,
+      text_object<TString> const* patch,
+      typename text_object<TString>::iterator patch_from,
+      typename text_object<TString>::iterator patch_to
+    ):
+      text_object<TString>(
+        make_rope(
+          base,
+          cut_from - base->begin(),
+          cut_to - base->begin(),
+          patch,
+          patch_from - patch->begin(),
+          patch_to - patch->begin()
+        )
+      ),
+      m_base(base),
+      m_patch_begin(patch_from),
+      m_postfix_begin(cut_to),
+      m_prefix_length(cut_from - base->begin()),
+      m_patch_length(patch_to - patch_from),
+      m_length(base->length() - (cut_to - cut_from) + (patch_to - patch_from))
+    {
+      this->decorates(*base);
+    }
+
+    text_replacement(
+      text_object<TString> const* base,
+      typename TString::size_type cut_from,
+      typename TString::size_type cut_to,
+      text_object<TString> const* patch,
+      typename TString::size_type patch_from,
+      typename TString::size_type patch_to
+    ):
+      text_object<TString>(
+        make_rope(
+          base,
+          cut_from,
+          cut_to,
+          patch,
+          patch_from,
+          patch_to
+        )
+      ),
+      m_base(base),
+      m_patch_begin(patch->begin() + patch_from),
+      m_postfix_begin(base->cbegin() + cut_to),
+      m_prefix_length(cut_from),
+      m_patch_length(patch_to - patch_from),
+      m_length(base->length() - (cut_to - cut_from) + (patch_to - patch_from))
+    {
+      this->decorates(*base);
+    }
+
+    text_object<TString> const* base() const { return m_base; }
+
+    // the edit in base offsets: [cut_from, cut_to) of the base became patch_length characters
+    typename TString::size_type cut_from() const { return m_prefix_length; }
+    typename TString::size_type cut_to() const { return m_postfix_begin.current_index(); }
+    typename TString::size_type patch_length() const { return m_patch_length; }
+};
+
+//  Replacement that only records the edit and builds its rope on first
+//  use, for bursts of edits of which only the last result is read, such as
+//  macro playback. The rope is built by applying, in one go, this edit and
+//  all the lazy edits below it that have not built their ropes either;
+//  those intermediate ropes are never built unless they are read too.
+template<class TString>
+class text_lazy_replacement : public text_object<TString>
+{
+  private:
+    text_object<TString> const* const m_base;
+    typename TString::size_type const m_cut_from;
+    typename TString::size_type const m_cut_to;
+    text_object<TString> const* const m_patch;
+    typename TString::size_type const m_patch_from;
+    typename TString::size_type const m_patch_to;
+
+    rope<TString> build_rope() const override {
+      std::vector<text_lazy_replacement const*> pending { this };
+
+      for (;;) {
+        auto const below = dynamic_cast<text_lazy_replacement const*>(pending.back()->m_base);
+        if (!below || below->is_built()) break;
+        pending.push_back(below);
+      }
+
+      auto result = pending.back()->m_base->get_rope();
+
+      for (auto it = pending.rbegin(); it != pending.rend(); ++it) {
+        auto const& e = **it;
+
+        // an erase has the text it erases from as its patch, which must not be built for nothing
+        auto const patch = e.m_patch_from == e.m_patch_to
+          ? rope<TString>()
+          : e.m_patch->get_rope().slice(e.m_patch_from, e.m_patch_to);
+
+        result = result.replace(e.m_cut_from, e.m_cut_to, patch);
+      }
+
+      return result;
+    }
+
+  public:
+    text_lazy_replacement(
+      text_object<TString> const* base,
+      typename TString::size_type cut_from,
+      typename TString::size_type cut_to,
+      text_object<TString> const* patch,
+      typename TString::size_type patch_from,
+      typename TString::size_type patch_to
+    ):
+      text_object<TString>(base->length() - (cut_to - cut_from) + (patch_to - patch_from)),
+      m_base(base),
+      m_cut_from(cut_from),
+      m_cut_to(cut_to),
+      m_patch(patch),
+      m_patch_from(patch_from),
+      m_patch_to(patch_to)
+    {
+      this->decorates(*base);
+
+      assert(cut_from <= cut_to);
+      assert(cut_to <= base->length());
+      assert(patch_from <= patch_to);
+      assert(patch_to <= patch->length());
+    }
+
+    text_object<TString> const* base() const { return m_base; }
+
+    typename TString::size_type cut_from() const { return m_cut_from; }
+    typename TString::size_type cut_to() const { return m_cut_to; }
+    typename TString::size_type patch_length() const { return m_patch_to - m_patch_from; }
+};
+
+//  One of the replacements applied at once by text_batch_replacement:
+//  [cut_from, cut_to) of the base is replaced with [patch_from, patch_to)
+//  of the patch. Offsets refer to the base, not to the text after the
+//  preceding replacements.
+template<class TString>
+struct replacement_step {
+  typename TString::size_type cut_from;
+  typename TString::size_type cut_to;
+  text_object<TString> const* patch;
+  typename TString::size_type patch_from;
+  typename TString::size_type patch_to;
+};
+
+//  Applies any number of replacements to the base as a single decorator,
+//  i.e. a single step of the edit history. The resulting rope is built in
+//  one pass over the replacements instead of one full edit per replacement.
+template<class TString>
+class text_batch_replacement : public text_object<TString>
+{
+  private:
+    text_object<TString> const* const m_base;
+    std::vector<replacement_step<TString> > const m_steps;
+
+    static rope<TString> make_rope(
+      text_object<TString> const* base,
+      std::vector<replacement_step<TString> > const& steps
+    ) {
+      auto const& base_rope = base->get_rope();
+
+      std::vector<typename rope<TString>::piece> pieces;
+      pieces.reserve(2 * steps.size() + 1);
+
+      typename TString::size_type kept_from = 0;
+
+      for (auto const& step : steps) {
+        if (step.cut_from < kept_from || step.cut_to < step.cut_from)
+        {
+          throw unordered_replacements();
+        }
+
+        assert(step.cut_to <= base->length());
+        assert(step.patch_from <= step.patch_to);
+        assert(step.patch_to <= step.patch->length());
+
+        pieces.push_back(typename rope<TString>::piece { &base_rope, kept_from, step.cut_from });
+        pieces.push_back(typename rope<TString>::piece { &step.patch->get_rope(), step.patch_from, step.patch_to });
+        kept_from = step.cut_to;
+      }
+
+      pieces.push_back(typename rope<TString>::piece { &base_rope, kept_from, base->length() });
+
+      // slicing makes about two cut paths of nodes per replacement, while
+      // assembling makes one node per segment of the result
+      if (2 * steps.size() * static_cast<std::size_t>(base_rope.height()) > base_rope.size()) {
+        return rope<TString>::assemble(pieces);
+      }
+
+      std::vector<rope<TString> > slices;
+      slices.reserve(pieces.size());
+
+      for (auto const& p : pieces) slices.push_back(p.source->slice(p.from, p.to));
+
+      return rope<TString>::concat_all(slices.begin(), slices.end());
+    }
+
+  public:
+    text_batch_replacement(
+      text_object<TString> const* base,
+      std::vector<replacement_step<TString> > const& steps
+    ):
+      text_object<TString>(make_rope(base, steps)),
+      m_base(base),
+      m_steps(steps)
+    {
+      this->decorates(*base);
+    }
+
+    text_object<TString> const* base() const { return m_base; }
+    std::vector<replacement_step<TString> > const& steps() const { return m_steps; }
+};
+
+//  Cursor of a multi-cursor editor, selecting [from, to) or, if both are
+//  equal, nothing.
+template<class TString>
+struct text_cursor {
+  typename TString::size_type from;
+  typename TString::size_type to;
+};
+
+//  Replaces the selection of every cursor, or inserts at a cursor that
+//  selects nothing, with the same patch, e.g. for typing with many
+//  cursors at once. It is a single decorator, and the rope is built in one
+//  pass over the cursors. Cursors must be in text order and must not
+//  overlap.
+template<class TString>
+class text_cursor_replacement : public text_batch_replacement<TString>
+{
+  private:
+    std::vector<text_cursor<TString> > const m_cursors;
+
+    static std::vector<replacement_step<TString> > make_steps(
+      std::vector<text_cursor<TString> > const& cursors,
+      text_object<TString> const* patch,
+      typename TString::size_type patch_from,
+      typename TString::size_type patch_to
+    ) {
+      std::vector<replacement_step<TString> > result;
+      result.reserve(cursors.size());
+
+      for (auto const& c : cursors) {
+        result.push_back(replacement_step<TString> { c.from, c.to, patch, patch_from, patch_to });
+      }
+
+      return result;
+    }
+
+  public:
+    text_cursor_replacement(
+      text_object<TString> const* base,
+      std::vector<text_cursor<TString> > const& cursors,
+      text_object<TString> const* patch,
+      typename TString::size_type patch_from,
+      typename TString::size_type patch_to
+    ):
+      text_batch_replacement<TString>(base, make_steps(cursors, patch, patch_from, patch_to)),
+      m_cursors(move_cursors(cursors, patch_to - patch_from))
+    {}
+
+    // where the cursors are in this text: each right after its patch, selecting nothing
+    std::vector<text_cursor<TString> > const& cursors() const { return m_cursors; }
+
+    // where cursors go when each has its selection replaced with patch_length characters
+    static std::vector<text_cursor<TString> > move_cursors(
+      std::vector<text_cursor<TString> > const& cursors,
+      typename TString::size_type patch_length
+    ) {
+      std::vector<text_cursor<TString> > result;
+      result.reserve(cursors.size());
+
+      // the growth of the text before the current cursor, modulo the size_type range
+      typename TString::size_type shift = 0;
+
+      for (auto const& c : cursors) {
+        auto const offset = c.from + shift + patch_length;
+
+        result.push_back(text_cursor<TString> { offset, offset });
+        shift += patch_length - (c.to - c.from);
+      }
+
+      return result;
+    }
+};
+
+//  Part of a text copied for pasting, into the same text or another one.
+//  It holds a slice of the rope of the source, i.e. the very segments of
+//  the source, so copying and pasting make rope nodes but never copy
+//  characters. owner keeps alive whatever holds those characters.
+template<class TString>
+class text_clipboard : public text_object<TString> {
+  private:
+    std::shared_ptr<void const> const m_owner;
+
+    static rope<TString> make_rope(
+      text_object<TString> const& source,
+      typename TString::size_type from,
+      typename TString::size_type to
+    ) {
+      if (from > to || to > source.length())
+      {
+        throw text_out_of_range(to, source.length());
+      }
+
+      return source.get_rope().slice(from, to);
+    }
+
+  public:
+    text_clipboard(
+      text_object<TString> const& source,
+      typename TString::size_type from,
+      typename TString::size_type to,
+      std::shared_ptr<void const> owner = std::shared_ptr<void const>()
+    ):
+      text_object<TString>(make_rope(source, from, to)),
+      m_owner(std::move(owner))
+    {}
+};
+
+//  Moves [from, to) of the base to target, an offset in the base outside
+//  the range; a target inside it leaves the text as it is. Only rope
+//  nodes are made, as the moved characters stay where they are.
+template<class TString>
+class text_move : public text_object<TString>
+{
+  private:
+    text_object<TString> const* const m_base;
+    typename TString::size_type const m_from;
+    typename TString::size_type const m_to;
+    typename TString::size_type const m_target;
+
+    static rope<TString> make_rope(
+      text_object<TString> const* base,
+      typename TString::size_type from,
+      typename TString::size_type to,
+      typename TString::size_type target
+    ) {
+      assert(from <= to);
+      assert(to <= base->length());
+      assert(target <= base->length());
+
+      auto const& r = base->get_rope();
+
+      if (from <= target && target <= to) return r;
+
+      auto const moved = r.slice(from, to);
+
+      return target < from
+        ? rope<TString>::concat(
+            rope<TString>::concat(r.slice(0, target), moved),
+            rope<TString>::concat(r.slice(target, from), r.slice(to, base->length()))
+          )
+        : rope<TString>::concat(
+            rope<TString>::concat(r.slice(0, from), r.slice(to, target)),
+            rope<TString>::concat(moved, r.slice(target, base->length()))
+          );
+    }
+
+  public:
+    text_move(
+      text_object<TString> const* base,
+      typename TString::size_type from,
+      typename TString::size_type to,
+      typename TString::size_type target
+    ):
+      text_object<TString>(make_rope(base, from, to, target)),
+      m_base(base),
+      m_from(from),
+      m_to(to),
+      m_target(target)
+    {
+      this->decorates(*base);
+    }
+
+    text_object<TString> const* base() const { return m_base; }
+
+    typename TString::size_type from() const { return m_from; }
+    typename TString::size_type to() const { return m_to; }
+    typename TString::size_type target() const { return m_target; }
+};
+
+//  Inserts a copy of [from, to) of the base at target, an offset in the
+//  base; the copy refers to the same segments as the original.
+template<class TString>
+class text_duplicate : public text_replacement<TString>
+{
+  public:
+    text_duplicate(
+      text_object<TString> const* base,
+      typename TString::size_type from,
+      typename TString::size_type to,
+      typename TString::size_type target
+    ):
+      text_replacement<TString>(base, target, target, base, from, to)
+    {}
+};
+
+//  Range [from, to) of a text object, e.g. the place where characters
+//  appended to an add buffer went; usable as the patch of a replacement.
+template<class TString>
+struct text_piece {
+  text_object<TString> const* source;
+  typename TString::size_type from;
+  typename TString::size_type to;
+};
+
+//  Append-only storage for typed text, as the add buffer of a piece table.
+//  Characters are written into preallocated blocks that never move, so
+//  pieces appended one after another are adjacent in memory and a run of
+//  keystrokes needs no allocation until a block is full. The buffer must
+//  outlive every text object that uses its pieces.
+template<class TString>
+class text_add_buffer {
+  private:
+    // leaf text spanning the whole capacity of the block; only the part
+    // below m_used has been written and is ever referenced by a piece
+    class block : public text_object<TString> {
+      private:
+        std::unique_ptr<TString> const m_storage;
+        typename TString::size_type m_used;
+
+        static rope<TString> storage_to_rope(TString const& storage) {
+          return rope<TString>(string_segment<TString>(storage.cbegin(), storage.cend()));
+        }
+
+        block(std::unique_ptr<TString> storage):
+          text_object<TString>(storage_to_rope(*storage)),
+          m_storage(std::move(storage)),
+          m_used(0)
+        {
+          TXED_STATS_ONLY(rope_stats::global().source_length += m_storage->length();)
+        }
+
+      public:
+        explicit block(typename TString::size_type capacity):
+          block(std::unique_ptr<TString>(new TString(capacity, typename TString::value_type())))
+        {}
+
+        TXED_STATS_ONLY(~block() { rope_stats::global().source_length -= m_storage->length(); })
+
+        typename TString::size_type used() const { return m_used; }
+        typename TString::size_type available() const { return m_storage->length() - m_used; }
+
+        template<class TIterator>
+        text_piece<TString> append(TIterator first, TIterator last) {
+          auto const from = m_used;
+
+          // element access does not invalidate iterators held by the rope
+          for (; first != last; ++first) (*m_storage)[m_used++] = *first;
+
+          return text_piece<TString> { this, from, m_used };
+        }
+    };
+
+    typename TString::size_type const m_block_length;
+    std::vector<std::shared_ptr<block> > m_blocks;
+
+  public:
+    static typename TString::size_type const default_block_length = 1 << 16;
+
+    explicit text_add_buffer(typename TString::size_type block_length = default_block_length):
+      m_block_length(block_length)
+    {}
+
+    template<class TIterator>
+    text_piece<TString> append(TIterator first, TIterator last) {
+      typename TString::size_type const length = std::distance(first, last);
+
+      if (m_blocks.empty() || m_blocks.back()->available() < length) {
+        m_blocks.emplace_back(std::make_shared<block>(std::max(m_block_length, length)));
+      }
+
+      return m_blocks.back()->append(first, last);
+    }
+
+    text_piece<TString> append(TString const& value) { return append(value.cbegin(), value.cend()); }
+
+    text_piece<TString> append(typename TString::value_type c) { return append(&c, &c + 1); }
+
+    // characters appended so far
+    typename TString::size_type size() const {
+      typename TString::size_type result = 0;
+      for (auto const& b : m_blocks) result += b->used();
+      return result;
+    }
+
+    // frees all blocks; no piece appended before may be in use any more
+    void clear() { m_blocks.clear(); }
+
+    // copies the pointers to the blocks from the given one on to out, for
+    // sharing them with whatever goes on referring to the characters in them
+    template<class TOutput>
+    TOutput share_blocks(TOutput out, std::size_t first = 0) const {
+      return std::copy(m_blocks.begin() + std::min(first, m_blocks.size()), m_blocks.end(), out);
+    }
+};
+
+//  Immutable text shared with other threads. A snapshot owns its text
+//  object and, through owner, whatever holds the characters its rope
+//  points into, so it stays readable however the history it was taken
+//  from changes afterwards. The rope is built when the snapshot is taken;
+//  from then on the text is only read, and any number of threads can read
+//  it at once. Copying a snapshot copies two shared pointers.
+//
+//  The snapshot does not keep the base or the patch of a decorator alive,
+//  so only the text itself may be read through it, not base().
+template<class TString>
+class text_snapshot {
+  private:
+    std::shared_ptr<text_object<TString> const> m_text;
+    std::shared_ptr<void const> m_owner;
+
+  public:
+    text_snapshot() {}
+
+    explicit text_snapshot(
+      std::shared_ptr<text_object<TString> const> text,
+      std::shared_ptr<void const> owner = std::shared_ptr<void const>()
+    ):
+      m_text(std::move(text)),
+      m_owner(std::move(owner))
+    {
+      if (m_text) m_text->get_rope();
+    }
+
+    text_object<TString> const& operator*() const { return *m_text; }
+    text_object<TString> const* operator->() const { return m_text.get(); }
+    text_object<TString> const* get() const { return m_text.get(); }
+
+    explicit operator bool() const { return static_cast<bool>(m_text); }
+};
+
+//  Bounds on the memory kept by an edit history; see text_history::compact.
+struct history_limits {
+  // revisions kept on the path to the current one
+  std::size_t max_revisions;
+  // bytes held by the strings that revisions refer to
+  std::size_t max_bytes;
+
+  static history_limits unlimited() {
+    return history_limits { static_cast<std::size_t>(-1), static_cast<std::size_t>(-1) };
+  }
+};
+
+//  Edit history owning the decorators. Revisions form a tree: the
+//  initial text is the root, and every edit adds a child to the current
+//  revision, so editing after an undo starts a new branch and keeps the
+//  old one. Each revision holds its complete rope, so undo, redo and
+//  jumping to any revision only switch the current one.
+//
+//  Old revisions can be dropped to bound memory (squash), and the whole
+//  history can be replaced by one fresh copy of the current text so that
+//  the strings the old revisions referred to are freed (flatten). Both
+//  renumber the revisions that are kept. A revision that becomes the root
+//  keeps its rope but its base, if any, is gone.
+template<class TString>
+class text_history {
+  friend class history_file<TString>;
+
+  public:
+    typedef std::size_t revision_id;
+
+    static revision_id const no_revision = static_cast<revision_id>(-1);
+
+  private:
+    struct revision {
+      std::shared_ptr<text_object<TString> const> text;
+      revision_id parent;
+      revision_id redo_child;
+    };
+
+    // one of the owners of what the texts of a history refer to, in a list
+    // that only grows at its head, so that a copy shares the list as it is
+    // and an entry can only own older ones; clipboards pasted back and
+    // forth between histories thus never own each other
+    struct owner_link {
+      std::shared_ptr<void const> owner;
+      std::shared_ptr<owner_link> previous;
+
+      owner_link(std::shared_ptr<void const> o, std::shared_ptr<owner_link> p):
+        owner(std::move(o)),
+        previous(std::move(p))
+      {}
+
+      // unlinked one by one, as releasing a long list recursively would
+      // overflow the stack; the owner goes first, as a clipboard pasted
+      // owns the links before it too
+      ~owner_link() {
+        owner.reset();
+
+        for (auto next = std::move(previous); next && next.use_count() == 1; ) {
+          next->owner.reset();
+          next = std::move(next->previous);
+        }
+      }
+    };
+
+    // strings the revisions refer to, i.e. the initial text and typed text;
+    // shared with the snapshots taken, so that flattening leaves their
+    // characters in place for as long as a snapshot still reads them
+    struct storage {
+      std::vector<std::shared_ptr<text_object<TString> const> > sources;
+      text_add_buffer<TString> add_buffer;
+      // the sources and blocks listed so far, then the clipboards pasted,
+      // which hold no characters of their own
+      std::shared_ptr<owner_link> owners;
+      std::size_t owned_sources = 0;
+      std::size_t owned_blocks = 0;
+
+      void own(std::shared_ptr<void const> owner) {
+        owners = std::make_shared<owner_link>(std::move(owner), std::move(owners));
+      }
+
+      // the owners of everything referred to so far; only the sources and
+      // blocks added since the last call are listed
+      std::shared_ptr<owner_link> const& all_owners() {
+        for (; owned_sources < sources.size(); ++owned_sources) own(sources[owned_sources]);
+
+        std::vector<std::shared_ptr<void const> > blocks;
+        add_buffer.share_blocks(std::back_inserter(blocks), owned_blocks);
+        for (auto& b : blocks) own(std::move(b));
+        owned_blocks += blocks.size();
+
+        return owners;
+      }
+    };
+
+    // declared first so that it outlives the revisions using it
+    std::shared_ptr<storage> m_storage;
+    std::vector<revision> m_revisions;
+    revision_id m_current;
+    history_limits m_limits;
+    bool m_lazy;
+
+    // where the edits keep their decorators and rope nodes; the slots of
+    // those squashed away are reused by the later edits, and flattening
+    // starts a new arena, the old one going with its last node
+    std::shared_ptr<rope_arena> m_arena;
+
+    void reset(std::shared_ptr<text_object<TString> const> const& initial) {
+      m_revisions.clear();
+      m_storage = std::make_shared<storage>();
+      m_arena = std::make_shared<rope_arena>();
+
+      m_storage->sources.push_back(initial);
+      m_revisions.push_back(revision { initial, no_revision, no_revision });
+      m_current = 0;
+    }
+
+    revision_id push(std::shared_ptr<text_object<TString> const> const& edit) {
+      auto const k = m_revisions.size();
+
+      m_revisions.push_back(revision { edit, m_current, no_revision });
+      m_revisions[m_current].redo_child = k;
+      m_current = k;
+
+      compact();
+
+      return m_current;
+    }
+
+    // builds an edit with its rope nodes and the decorator itself in the
+    // arena; compacting is left out of it, so that a flattened text does
+    // not take its nodes from there
+    template<class TEdit, class... TArgs>
+    revision_id emplace(TArgs&&... args) {
+      std::shared_ptr<TEdit const> edit;
+
+      {
+        rope_arena::scope const in_arena(m_arena);
+        edit = std::allocate_shared<TEdit>(arena_allocator<TEdit>(m_arena), std::forward<TArgs>(args)...);
+      }
+
+      return push(edit);
+    }
+
+    // keeps new_root and the revisions descending from it that are wanted
+    // and whose parents are kept; all of them if wanted is empty
+    void keep(revision_id new_root, std::vector<bool> const& wanted) {
+      // a lazy revision needs its base for building its rope, and the base is about to go
+      at(new_root).text->get_rope();
+
+      // a parent always precedes its children, so one forward pass finds the subtree
+      std::vector<revision_id> new_ids(m_revisions.size(), no_revision);
+      revision_id kept = 0;
+
+      for (revision_id k = new_root; k < m_revisions.size(); ++k) {
+        auto const parent = m_revisions[k].parent;
+
+        if (
+          k == new_root ||
+          (parent != no_revision && new_ids[parent] != no_revision && (wanted.empty() || wanted[k]))
+        ) {
+          new_ids[k] = kept++;
+        }
+      }
+
+      if (new_ids[m_current] == no_revision)
+      {
+        m_current = new_root;
+      }
+
+      std::vector<revision> revisions;
+      revisions.reserve(kept);
+
+      auto const remap = [&new_ids](revision_id k) { return k == no_revision ? no_revision : new_ids[k]; };
+
+      for (revision_id k = new_root; k < m_revisions.size(); ++k) {
+        if (new_ids[k] == no_revision) continue;
+
+        auto& r = m_revisions[k];
+        revisions.push_back(revision { std::move(r.text), remap(r.parent), remap(r.redo_child) });
+      }
+
+      revisions.front().parent = no_revision;
+      m_current = new_ids[m_current];
+      m_revisions.swap(revisions);
+    }
+
+    revision& at(revision_id k) {
+      if (k >= m_revisions.size())
+      {
+        throw revision_out_of_range();
+      }
+
+      return m_revisions[k];
+    }
+
+    revision const& at(revision_id k) const {
+      if (k >= m_revisions.size())
+      {
+        throw revision_out_of_range();
+      }
+
+      return m_revisions[k];
+    }
+
+    // empty, for history_file to fill in
+    explicit text_history(history_limits const& limits):
+      m_current(0),
+      m_limits(limits),
+      m_lazy(false)
+    {}
+
+  public:
+    explicit text_history(
+      std::unique_ptr<text_object<TString> const> initial,
+      history_limits const& limits = history_limits::unlimited()
+    ):
+      m_current(0),
+      m_limits(limits),
+      m_lazy(false)
+    {
+      reset(std::move(initial));
+    }
+
+    // the initial text may be shared, e.g. one taken from a text_stream_builder
+    explicit text_history(
+      std::shared_ptr<text_object<TString> const> const& initial,
+      history_limits const& limits = history_limits::unlimited()
+    ):
+      m_current(0),
+      m_limits(limits),
+      m_lazy(false)
+    {
+      reset(initial);
+    }
+
+    explicit text_history(TString const& value, history_limits const& limits = history_limits::unlimited()):
+      text_history(std::unique_ptr<text_object<TString> const>(new text_string<TString>(value)), limits)
+    {}
+
+    text_object<TString> const& current() const { return *m_revisions[m_current].text; }
+    text_object<TString> const& text(revision_id k) const { return *at(k).text; }
+
+    // the current text or any revision, for reading on other threads while
+    // the history goes on changing; patches that came from outside the
+    // history must outlive the snapshot
+    text_snapshot<TString> snapshot() const { return snapshot(m_current); }
+    text_snapshot<TString> snapshot(revision_id k) const { return text_snapshot<TString>(at(k).text, m_storage); }
+
+    revision_id current_revision() const { return m_current; }
+    revision_id parent(revision_id k) const { return at(k).parent; }
+    std::size_t size() const { return m_revisions.size(); }
+
+    bool can_undo() const { return m_revisions[m_current].parent != no_revision; }
+    bool can_redo() const { return m_revisions[m_current].redo_child != no_revision; }
+
+    // in lazy mode, replacements are text_lazy_replacement and build their ropes only when read
+    bool lazy() const { return m_lazy; }
+    void set_lazy(bool lazy) { m_lazy = lazy; }
+
+    history_limits const& limits() const { return m_limits; }
+    void set_limits(history_limits const& limits) { m_limits = limits; compact(); }
+
+    // size of the strings that the revisions refer to, in bytes
+    std::size_t source_bytes() const {
+      std::size_t result = m_storage->add_buffer.size();
+      for (auto const& s : m_storage->sources) result += s->length();
+      return result * sizeof(typename TString::value_type);
+    }
+
+    // makes an edit of the current text the new current revision and
+    // compacts the history if it is over the limits; returns the id of the
+    // new revision. edit must be a decorator whose base is current()
+    revision_id apply(std::unique_ptr<text_object<TString> const> edit) { return push(std::move(edit)); }
+
+    revision_id replace(
+      typename TString::size_type cut_from,
+      typename TString::size_type cut_to,
+      text_object<TString> const* patch,
+      typename TString::size_type patch_from,
+      typename TString::size_type patch_to
+    ) {
+      return m_lazy
+        ? emplace<text_lazy_replacement<TString> >(&current(), cut_from, cut_to, patch, patch_from, patch_to)
+        : emplace<text_replacement<TString> >(&current(), cut_from, cut_to, patch, patch_from, patch_to);
+    }
+
+    revision_id replace(typename TString::size_type cut_from, typename TString::size_type cut_to, text_piece<TString> const& patch) {
+      return replace(cut_from, cut_to, patch.source, patch.from, patch.to);
+    }
+
+    revision_id replace(typename TString::size_type cut_from, typename TString::size_type cut_to, TString const& value) {
+      return replace(cut_from, cut_to, m_storage->add_buffer.append(value));
+    }
+
+    revision_id replace(std::vector<replacement_step<TString> > const& steps) {
+      return emplace<text_batch_replacement<TString> >(&current(), steps);
+    }
+
+    // the value is appended to the add buffer once and shared by all the
+    // cursors; see text_cursor_replacement::move_cursors for where they go
+    revision_id replace(std::vector<text_cursor<TString> > const& cursors, TString const& value) {
+      auto const patch = m_storage->add_buffer.append(value);
+      return emplace<text_cursor_replacement<TString> >(&current(), cursors, patch.source, patch.from, patch.to);
+    }
+
+    revision_id insert(typename TString::size_type offset, TString const& value) { return replace(offset, offset, value); }
+
+    revision_id move(typename TString::size_type from, typename TString::size_type to, typename TString::size_type target) {
+      return emplace<text_move<TString> >(&current(), from, to, target);
+    }
+
+    revision_id duplicate(typename TString::size_type from, typename TString::size_type to, typename TString::size_type target) {
+      return emplace<text_duplicate<TString> >(&current(), from, to, target);
+    }
+
+    // [from, to) of the current text, for pasting into this or another
+    // history. It shares the owners of the strings it refers to rather than
+    // the whole storage of this history, so that histories pasting from
+    // each other never keep each other alive
+    std::shared_ptr<text_clipboard<TString> const> copy(typename TString::size_type from, typename TString::size_type to) const {
+      return std::make_shared<text_clipboard<TString> const>(current(), from, to, m_storage->all_owners());
+    }
+
+    revision_id paste(typename TString::size_type offset, std::shared_ptr<text_clipboard<TString> const> const& clipboard) {
+      m_storage->own(clipboard);
+      return replace(offset, offset, clipboard.get(), 0, clipboard->length());
+    }
+
+    revision_id erase(typename TString::size_type from, typename TString::size_type to) {
+      return replace(from, to, &current(), 0, 0);
+    }
+
+    // go to the parent revision; the one left becomes the target of redo
+    void undo() {
+      auto const k = m_revisions[m_current].parent;
+
+      if (k == no_revision)
+      {
+        throw revision_out_of_range();
+      }
+
+      m_revisions[k].redo_child = m_current;
+      m_current = k;
+    }
+
+    // go to the child revision last undone from or created
+    void redo() {
+      auto const k = m_revisions[m_current].redo_child;
+
+      if (k == no_revision)
+      {
+        throw revision_out_of_range();
+      }
+
+      m_current = k;
+    }
+
+    // make any revision current, whichever branch it is on
+    void jump(revision_id k) {
+      at(k);
+      m_current = k;
+    }
+
+    // keeps only new_root and the revisions descending from it
+    void squash(revision_id new_root) { keep(new_root, std::vector<bool>()); }
+
+    // keeps only the revisions on the path from the root to the current one
+    // and those that redo goes through from there, as many as the limit allows
+    void prune_branches() {
+      std::vector<bool> wanted(m_revisions.size(), false);
+      std::size_t count = 0;
+
+      for (auto k = m_current; k != no_revision; k = m_revisions[k].parent, ++count) wanted[k] = true;
+
+      for (
+        auto k = m_revisions[m_current].redo_child;
+        k != no_revision && count < m_limits.max_revisions;
+        k = m_revisions[k].redo_child, ++count
+      ) {
+        wanted[k] = true;
+      }
+
+      keep(0, wanted);
+    }
+
+    // replaces the whole history with a copy of the current text in a new
+    // string, releasing everything the old revisions referred to
+    void flatten() {
+      reset(std::make_shared<text_string<TString> const>(current().to_string()));
+    }
+
+    // squashes the history down to half of the allowed number of revisions
+    // on the current path if it has more than allowed, pruning the branches
+    // off that path if they keep it over the limit, then flattens it if
+    // the strings it refers to take more bytes than allowed and at least
+    // half of them is no longer part of the current text
+    void compact() {
+      if (m_revisions.size() > m_limits.max_revisions) {
+        auto new_root = m_current;
+
+        for (std::size_t depth = 1; depth < std::max<std::size_t>(1, m_limits.max_revisions / 2); ++depth) {
+          auto const parent = m_revisions[new_root].parent;
+          if (parent == no_revision) break;
+          new_root = parent;
+        }
+
+        squash(new_root);
+
+        // e.g. after many edits each undone, which leave branches of their own
+        if (m_revisions.size() > m_limits.max_revisions) prune_branches();
+      }
+
+      auto const bytes = source_bytes();
+
+      if (bytes > m_limits.max_bytes && bytes / 2 > current().length() * sizeof(typename TString::value_type)) {
+        flatten();
+      }
+    }
+};
+
+//  Part of a text that differs in another one, as found by diff:
+//  [cut_from, cut_to) of the old text became [patch_from, patch_to) of the
+//  new one. Used as replacement steps with the new text as the patch, the
+//  hunks turn the old text into the new one.
+template<class TString>
+struct text_hunk {
+  typename TString::size_type cut_from;
+  typename TString::size_type cut_to;
+  typename TString::size_type patch_from;
+  typename TString::size_type patch_to;
+};
+
+//  Differences between two texts, in text order. Revisions of a document
+//  share the strings their segments point into, so characters at the same
+//  address in both texts are equal without being compared: the segments
+//  of the new text are matched against those of the old one by address,
+//  and characters are compared only at the edges of the parts left
+//  unmatched. The cost is linear in the number of segments rather than in
+//  the length, unless the texts share no strings at all, as two copies of
+//  the same file loaded separately do. A block that was moved shows as
+//  deleted and inserted. Needs TString to keep its characters contiguously.
+template<class TString>
+std::vector<text_hunk<TString> > diff(text_object<TString> const& a, text_object<TString> const& b) {
+  typedef typename TString::size_type size_type;
+  typedef typename TString::const_pointer pointer;
+
+  struct piece {
+    pointer begin;
+    size_type length;
+    size_type offset;
+  };
+
+  // the segments of a ordered by where their characters are
+  std::vector<piece> by_address;
+  size_type a_offset = 0;
+
+  for (auto const& span : a.spans()) {
+    if (span.second) by_address.push_back(piece { span.first, span.second, a_offset });
+    a_offset += span.second;
+  }
+
+  std::less<pointer> const before;
+
+  std::sort(by_address.begin(), by_address.end(), [&before](piece const& x, piece const& y) {
+    return before(x.begin, y.begin);
+  });
+
+  std::vector<text_hunk<TString> > result;
+  size_type a_matched = 0;
+  size_type b_matched = 0;
+  size_type b_offset = 0;
+
+  // characters of b found in a at a_from onwards, after the ones matched so far
+  auto const match = [&](size_type b_from, size_type a_from, size_type length) {
+    if (a_from < a_matched) return;
+
+    if (a_matched < a_from || b_matched < b_from) {
+      result.push_back(text_hunk<TString> { a_matched, a_from, b_matched, b_from });
+    }
+
+    a_matched = a_from + length;
+    b_matched = b_from + length;
+  };
+
+  for (auto const& span : b.spans()) {
+    auto p = span.first;
+    auto const end = span.first + span.second;
+
+    while (p != end) {
+      auto it = std::upper_bound(by_address.begin(), by_address.end(), p, [&before](pointer x, piece const& y) {
+        return before(x, y.begin);
+      });
+
+      if (it != by_address.begin() && before(p, std::prev(it)->begin + std::prev(it)->length)) {
+        auto const& found = *std::prev(it);
+        auto const length = std::min<size_type>(end - p, found.begin + found.length - p);
+
+        match(b_offset, found.offset + (p - found.begin), length);
+        p += length;
+        b_offset += length;
+      } else {
+        // not in a up to where the next segment of a begins, if within the span
+        auto const next = it != by_address.end() && before(it->begin, end) ? it->begin : end;
+
+        b_offset += next - p;
+        p = next;
+      }
+    }
+  }
+
+  if (a_matched < a.length() || b_matched < b.length()) {
+    result.push_back(text_hunk<TString> { a_matched, a.length(), b_matched, b.length() });
+  }
+
+  // the unmatched parts may still begin or end with equal characters, e.g.
+  // where a deleted word was typed again or the texts share no strings
+  std::vector<text_hunk<TString> > trimmed;
+
+  for (auto h : result) {
+    auto x = a.begin() + h.cut_from;
+    auto y = b.begin() + h.patch_from;
+
+    for (; h.cut_from < h.cut_to && h.patch_from < h.patch_to && *x == *y; ++x, ++y, ++h.cut_from, ++h.patch_from) {}
+
+    x = a.begin() + h.cut_to;
+    y = b.begin() + h.patch_to;
+
+    for (; h.cut_from < h.cut_to && h.patch_from < h.patch_to && *--x == *--y; --h.cut_to, --h.patch_to) {}
+
+    if (h.cut_from < h.cut_to || h.patch_from < h.patch_to) trimmed.push_back(h);
+  }
+
+  return trimmed;
+}
+
+//  Non-overlapping matches of a needle in a text, as found by find_all.
+//  After an edit, the matches in the edited text are derived from those in
+//  its base: the ones clear of the edit are kept or shifted, and only the
+//  neighbourhood of the patch is scanned again, until the matches found
+//  fall back in step with the shifted old ones.
+template<class TString>
+class text_search {
+  public:
+    typedef std::vector<typename TString::size_type> hit_list;
+
+  private:
+    // not const, so that a running search can be assigned its update after each edit
+    TString m_needle;
+    text_object<TString> const* m_text;
+    hit_list m_hits;
+
+    static hit_list update_hits(
+      text_search const& previous,
+      text_object<TString> const& text,
+      typename TString::size_type cut_from,
+      typename TString::size_type cut_to,
+      typename TString::size_type patch_length
+    ) {
+      auto const& needle = previous.m_needle;
+      auto const& old_hits = previous.m_hits;
+      auto const m = needle.length();
+      auto const patch_end = cut_from + patch_length;
+
+      hit_list result;
+
+      // matches ending before the cut saw nothing of the edit
+      auto it = old_hits.begin();
+      for (; it != old_hits.end() && *it + m <= cut_from; ++it) result.push_back(*it);
+
+      // matches starting after the cut are intact, just moved
+      auto after = std::lower_bound(it, old_hits.end(), cut_to);
+      auto const shift = [=](typename TString::size_type h) { return h - cut_to + patch_end; };
+
+      auto from = cut_from + 1 > m ? cut_from + 1 - m : 0;
+      if (!result.empty()) from = std::max(from, result.back() + m);
+
+      bool in_step = false;
+
+      if (m != 0 && from <= text.length()) {
+        text.scan(needle, from, text.length(), [&](typename TString::size_type offset) {
+          if (offset >= patch_end) {
+            while (after != old_hits.end() && shift(*after) < offset) ++after;
+            in_step = after != old_hits.end() && shift(*after) == offset;
+          }
+
+          if (!in_step) result.push_back(offset);
+
+          return !in_step;
+        });
+      }
+
+      if (in_step) {
+        for (; after != old_hits.end(); ++after) result.push_back(shift(*after));
+      }
+
+      return result;
+    }
+
+  public:
+    text_search(text_object<TString> const& text, TString const& needle):
+      m_needle(needle),
+      m_text(&text),
+      m_hits(text.find_all(needle))
+    {}
+
+    // matches in text, which is previous.text() with [cut_from, cut_to) replaced by patch_length characters
+    text_search(
+      text_search const& previous,
+      text_object<TString> const& text,
+      typename TString::size_type cut_from,
+      typename TString::size_type cut_to,
+      typename TString::size_type patch_length
+    ):
+      m_needle(previous.m_needle),
+      m_text(&text),
+      m_hits(update_hits(previous, text, cut_from, cut_to, patch_length))
+    {}
+
+    // matches in edit, whose base must be previous.text()
+    text_search(text_search const& previous, text_replacement<TString> const& edit):
+      text_search(previous, edit, edit.cut_from(), edit.cut_to(), edit.patch_length())
+    {
+      assert(edit.base() == previous.m_text);
+    }
+
+    TString const& needle() const { return m_needle; }
+    text_object<TString> const& text() const { return *m_text; }
+    hit_list const& hits() const { return m_hits; }
+};
+
+//  Offsets in a text that follow it through its edits, e.g. bookmarks,
+//  diagnostics or highlighted spans. The anchors are kept in treaps
+//  ordered by offset, whose subtrees carry pending updates that are pushed
+//  down only when a path through them is walked. An edit splits the
+//  anchors into those before, within and after it and tags two subtrees,
+//  so it costs O(log n) however many anchors it moves.
+//
+//  Like markers in Emacs, an anchor within the text cut by an edit goes to
+//  where the cut was, and an anchor where a patch goes stays before it if
+//  it sticks to the left, or goes after it if it sticks to the right.
+//  Anchors only follow edits forwards; undoing an edit does not take them
+//  back.
+template<class TString>
+class text_anchors {
+  public:
+    typedef std::uint32_t anchor_id;
+
+    enum gravity { sticks_left, sticks_right };
+
+  private:
+    typedef typename TString::size_type size_type;
+    typedef std::uint32_t index;
+
+    static index const none = static_cast<index>(-1);
+
+    // offset -> value if collapse, else offset -> offset + value modulo the size_type range
+    struct update {
+      bool collapse;
+      size_type value;
+
+      size_type operator()(size_type offset) const { return collapse ? value : offset + value; }
+
+      // this update made after the earlier one
+      update after(update const& earlier) const {
+        return collapse ? *this : update { earlier.collapse, earlier.value + value };
+      }
+
+      bool is_identity() const { return !collapse && value == 0; }
+    };
+
+    struct node {
+      size_type offset;
+      std::uint32_t priority;
+      index left;
+      index right;
+      index parent;
+      // applies to the subtrees, not to offset, which is up to date
+      update pending;
+      gravity side;
+      bool used;
+    };
+
+    std::vector<node> m_nodes;
+    std::vector<index> m_free;
+    index m_roots[2];
+    std::size_t m_size;
+    std::uint32_t m_random;
+
+    std::uint32_t next_priority() {
+      // xorshift, good enough for balancing
+      m_random ^= m_random << 13;
+      m_random ^= m_random >> 17;
+      m_random ^= m_random << 5;
+      return m_random;
+    }
+
+    void apply(index i, update const& u) {
+      if (i == none) return;
+
+      auto& n = m_nodes[i];
+      n.offset = u(n.offset);
+      n.pending = u.after(n.pending);
+    }
+
+    void push(index i) {
+      auto& n = m_nodes[i];
+
+      if (n.pending.is_identity()) return;
+
+      apply(n.left, n.pending);
+      apply(n.right, n.pending);
+      n.pending = update { false, 0 };
+    }
+
+    void set_left(index i, index child) {
+      m_nodes[i].left = child;
+      if (child != none) m_nodes[child].parent = i;
+    }
+
+    void set_right(index i, index child) {
+      m_nodes[i].right = child;
+      if (child != none) m_nodes[child].parent = i;
+    }
+
+    // the anchors of the treap at i before key, and the rest
+    std::pair<index, index> split(index i, size_type key) {
+      if (i == none) return std::make_pair(none, none);
+
+      push(i);
+
+      if (m_nodes[i].offset < key) {
+        auto const rest = split(m_nodes[i].right, key);
+        set_right(i, rest.first);
+        m_nodes[i].parent = none;
+        if (rest.second != none) m_nodes[rest.second].parent = none;
+        return std::make_pair(i, rest.second);
+      } else {
+        auto const rest = split(m_nodes[i].left, key);
+        set_left(i, rest.second);
+        m_nodes[i].parent = none;
+        if (rest.first != none) m_nodes[rest.first].parent = none;
+        return std::make_pair(rest.first, i);
+      }
+    }
+
+    // all of a, then all of b, whose offsets are not less
+    index merge(index a, index b) {
+      if (a == none) return b;
+      if (b == none) return a;
+
+      if (m_nodes[a].priority > m_nodes[b].priority) {
+        push(a);
+        set_right(a, merge(m_nodes[a].right, b));
+        return a;
+      } else {
+        push(b);
+        set_left(b, merge(a, m_nodes[b].left));
+        return b;
+      }
+    }
+
+    index merge(index a, index b, index c) { return merge(merge(a, b), c); }
+
+    void set_root(int side, index i) {
+      m_roots[side] = i;
+      if (i != none) m_nodes[i].parent = none;
+    }
+
+    void replace(int side, size_type cut_from, size_type cut_to, size_type patch_length) {
+      auto const before = split(m_roots[side], cut_from);
+      auto const rest = split(before.second, cut_to + 1);
+
+      apply(rest.first, update { true, side == sticks_left ? cut_from : cut_from + patch_length });
+      apply(rest.second, update { false, patch_length - (cut_to - cut_from) });
+
+      set_root(side, merge(before.first, rest.first, rest.second));
+    }
+
+    void move(int side, size_type from, size_type to, size_type target) {
+      // an anchor at target goes before the moved range if it sticks to the left
+      auto const at_target = side == sticks_left ? target + 1 : target;
+
+      if (target < from) {
+        // [target, from) and [from, to) swap places
+        auto const a = split(m_roots[side], at_target);
+        auto const b = split(a.second, from);
+        auto const c = split(b.second, to);
+
+        apply(b.first, update { false, to - from });
+        apply(c.first, update { false, target - from });
+        set_root(side, merge(merge(a.first, c.first), merge(b.first, c.second)));
+      } else {
+        // [from, to) and [to, target) swap places
+        auto const a = split(m_roots[side], from);
+        auto const b = split(a.second, to);
+        auto const c = split(b.second, at_target);
+
+        apply(b.first, update { false, target - to });
+        apply(c.first, update { false, from - to });
+        set_root(side, merge(merge(a.first, c.first), merge(b.first, c.second)));
+      }
+    }
+
+    node const& live(anchor_id id) const {
+      if (id >= m_nodes.size() || !m_nodes[id].used)
+      {
+        throw std::out_of_range("No such anchor");
+      }
+
+      return m_nodes[id];
+    }
+
+  public:
+    text_anchors():
+      m_size(0),
+      m_random(2463534242u)
+    {
+      m_roots[sticks_left] = none;
+      m_roots[sticks_right] = none;
+    }
+
+    std::size_t size() const { return m_size; }
+
+    anchor_id add(size_type offset, gravity side = sticks_left) {
+      index i;
+
+      if (m_free.empty()) {
+        i = static_cast<index>(m_nodes.size());
+        m_nodes.push_back(node());
+      } else {
+        i = m_free.back();
+        m_free.pop_back();
+      }
+
+      m_nodes[i] = node { offset, next_priority(), none, none, none, update { false, 0 }, side, true };
+
+      auto const parts = split(m_roots[side], offset);
+      set_root(side, merge(parts.first, i, parts.second));
+      ++m_size;
+
+      return i;
+    }
+
+    void remove(anchor_id id) {
+      auto const& n = live(id);
+
+      // the updates pending above the node are pushed down past it first
+      std::vector<index> path;
+      for (index i = n.parent; i != none; i = m_nodes[i].parent) path.push_back(i);
+      for (auto it = path.rbegin(); it != path.rend(); ++it) push(*it);
+      push(id);
+
+      auto const parent = n.parent;
+      auto const joined = merge(n.left, n.right);
+
+      if (parent == none) {
+        set_root(n.side, joined);
+      } else if (m_nodes[parent].left == id) {
+        set_left(parent, joined);
+      } else {
+        set_right(parent, joined);
+      }
+
+      m_nodes[id].used = false;
+      m_free.push_back(id);
+      --m_size;
+    }
+
+    // the offset of the anchor after all the edits so far
+    size_type offset(anchor_id id) const {
+      auto const& n = live(id);
+      auto result = n.offset;
+
+      // the updates pending further up were made later
+      for (index i = n.parent; i != none; i = m_nodes[i].parent) result = m_nodes[i].pending(result);
+
+      return result;
+    }
+
+    // [cut_from, cut_to) of the text became patch_length characters
+    void replace(size_type cut_from, size_type cut_to, size_type patch_length) {
+      assert(cut_from <= cut_to);
+
+      replace(sticks_left, cut_from, cut_to, patch_length);
+      replace(sticks_right, cut_from, cut_to, patch_length);
+    }
+
+    // [from, to) of the text was moved to target, an offset outside it;
+    // the anchors in the range go with it
+    void move(size_type from, size_type to, size_type target) {
+      assert(from <= to);
+
+      if (from <= target && target <= to) return;
+
+      move(sticks_left, from, to, target);
+      move(sticks_right, from, to, target);
+    }
+
+    // follows the edit that made text from its base, if it is one of the
+    // decorators of this header; returns whether it is
+    bool apply(text_object<TString> const& text) {
+      if (auto const e = dynamic_cast<text_replacement<TString> const*>(&text)) {
+        replace(e->cut_from(), e->cut_to(), e->patch_length());
+      } else if (auto const e = dynamic_cast<text_lazy_replacement<TString> const*>(&text)) {
+        replace(e->cut_from(), e->cut_to(), e->patch_length());
+      } else if (auto const e = dynamic_cast<text_batch_replacement<TString> const*>(&text)) {
+        // the steps are in base offsets, which the later steps do not change for the earlier ones
+        auto const& steps = e->steps();
+
+        for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+          replace(it->cut_from, it->cut_to, it->patch_to - it->patch_from);
+        }
+      } else if (auto const e = dynamic_cast<text_move<TString> const*>(&text)) {
+        move(e->from(), e->to(), e->target());
+      } else {
+        return false;
+      }
+
+      return true;
+    }
+};
+
+template<class TString> typename TString::size_type const rope<TString>::max_segment_length;
+template<class TString> typename TString::size_type const rope<TString>::unknown;
+template<class TString> std::uint32_t const rope<TString>::unknown_in_segment;
+template<class TString> typename TString::size_type const text_add_buffer<TString>::default_block_length;
+template<class TString> typename TString::size_type const text_stream_builder<TString>::default_chunk_length;
+template<class TString> typename text_history<TString>::revision_id const text_history<TString>::no_revision;
+template<class TString> typename text_anchors<TString>::index const text_anchors<TString>::none;
+
+//  Read-only snapshot of a text with the rope laid out flat: the end
+//  offsets of the segments in one sorted array, searched without branches,
+//  and the segments in another. Meant for texts that are only read, e.g.
+//  for rendering or export, where walking tree nodes costs cache misses.
+//  Like the text it was made from, it refers to the source strings.
+template<class TString>
+class frozen_text {
+  friend class text_object<TString>;
+
+  private:
+    std::vector<typename TString::size_type> m_ends;
+    std::vector<typename TString::const_iterator> m_begins;
+
+    explicit frozen_text(rope<TString> const& r) {
+      m_ends.reserve(r.size());
+      m_begins.reserve(r.size());
+
+      for (auto const& node : r) {
+        m_ends.push_back(node.first);
+        m_begins.push_back(node.second.first);
+      }
+    }
+
+    // index of the first segment ending after offset
+    std::size_t locate(typename TString::size_type offset) const {
+      auto first = m_ends.data();
+      auto count = m_ends.size();
+
+      while (count > 1) {
+        auto const half = count / 2;
+        first = first[half - 1] <= offset ? first + half : first;
+        count -= half;
+      }
+
+      return (first - m_ends.data()) + (*first <= offset);
+    }
+
+  public:
+    typename TString::size_type length() const { return m_ends.empty() ? 0 : m_ends.back(); }
+    std::size_t segment_count() const { return m_ends.size(); }
+
+    typename TString::size_type segment_begin_offset(std::size_t k) const { return k ? m_ends[k - 1] : 0; }
+    typename TString::size_type segment_end_offset(std::size_t k) const { return m_ends[k]; }
+
+    string_segment<TString> segment(std::size_t k) const {
+      return string_segment<TString>(m_begins[k], m_begins[k] + (m_ends[k] - segment_begin_offset(k)));
+    }
+
+    typename TString::const_reference at(typename TString::size_type i) const {
+      if (i >= length())
+      {
+        throw text_out_of_range(i, length());
+      }
+
+      auto const k = locate(i);
+
+      return *(m_begins[k] + (i - segment_begin_offset(k)));
+    }
+
+    typename TString::value_type* copy_to(
+      typename TString::value_type* out,
+      typename TString::size_type from,
+      typename TString::size_type to
+    ) const {
+      if (from > to || to > length())
+      {
+        throw text_out_of_range(to, length());
+      }
+
+      for (auto k = from < to ? locate(from) : m_ends.size(); k < m_ends.size() && segment_begin_offset(k) < to; ++k) {
+        auto const begin_offset = segment_begin_offset(k);
+        auto const first = m_begins[k] + (std::max(from, begin_offset) - begin_offset);
+        auto const last = m_begins[k] + (std::min(to, m_ends[k]) - begin_offset);
+
+        out = std::copy(first, last, out);
+      }
+
+      return out;
+    }
+
+    TString to_string() const {
+      TString result;
+      result.reserve(length());
+
+      for (std::size_t k = 0; k < m_ends.size(); ++k) {
+        auto const s = segment(k);
+        result.append(s.first, s.second);
+      }
+
+      return result;
+    }
+};
+
+template<class TString>
+frozen_text<TString> text_object<TString>::freeze() const { return frozen_text<TString>(get_rope()); }
+
+template<class TString> bool text_iterator<TString>::is_begin() const { return is_at(0); }
+template<class TString> bool text_iterator<TString>::is_end() const { return is_at(m_target->length()); }
+template<class TString> void text_iterator<TString>::move_to_begin() { move_to(0); }
+template<class TString> void text_iterator<TString>::move_to_end() { move_to(m_target->length()); }
+
+template<class TString>
+void text_iterator<TString>::seek() const {
+  if (m_current_index >= m_target->length())
+  {
+    throw text_out_of_range(m_current_index, m_target->length());
+  }
+
+  TXED_STATS_ONLY(m_target->count_lookup();)
+
+  auto const segment_node = m_target->get_rope().segment_at(m_current_index);
+  auto const& segment = segment_node.second;
+
+  m_segment_end_offset = segment_node.first;
+  m_segment_begin_offset = m_segment_end_offset - (segment.second - segment.first);
+  m_segment_begin = segment.first;
+}
+
+template<class TString>
+typename TString::const_reference text_iterator<TString>::operator*() const {
+  if (!in_segment()) seek();
+
+  return *(m_segment_begin + (m_current_index - m_segment_begin_offset));
+}
+
+};
+
+#endif
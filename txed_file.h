@@ -0,0 +1,636 @@
+//  File-backed text objects for the text editor object model.
+//
+//  A mapped file is a leaf text object, like a text string, whose
+//  segments point into a read-only memory mapping of the file. Opening
+//  does not read the file, and pages are read from disk only when the
+//  characters on them are actually accessed.
+//
+//  Saving writes the segments of a text straight from the rope, without
+//  a copy of the whole text, into a temporary file that replaces the
+//  target only once it is complete and on disk.
+//
+//  A whole edit history can be saved in a binary file and mapped back,
+//  see history_file.
+//
+//  POSIX only. The file must not be truncated while it is mapped.
+
+#ifndef TXED_FILE_H
+#define TXED_FILE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "txed.h"
+
+namespace text_edit {
+
+inline std::system_error os_error(std::string const& what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+class mapped_region {
+  private:
+    void* m_address;
+    std::size_t m_size;
+
+    mapped_region(mapped_region const&) = delete;
+    mapped_region& operator=(mapped_region const&) = delete;
+
+  public:
+    explicit mapped_region(std::string const& path):
+      m_address(nullptr),
+      m_size(0)
+    {
+      int const fd = ::open(path.c_str(), O_RDONLY);
+
+      if (fd < 0)
+      {
+        throw os_error("Cannot open " + path);
+      }
+
+      struct stat info;
+
+      if (::fstat(fd, &info) != 0)
+      {
+        auto const error = os_error("Cannot stat " + path);
+        ::close(fd);
+        throw error;
+      }
+
+      m_size = info.st_size;
+
+      // an empty file cannot be mapped and needs no mapping anyway
+      if (m_size != 0)
+      {
+        m_address = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (m_address == MAP_FAILED)
+        {
+          auto const error = os_error("Cannot map " + path);
+          ::close(fd);
+          throw error;
+        }
+      }
+
+      // the mapping stays valid after the descriptor is closed
+      ::close(fd);
+    }
+
+    ~mapped_region() {
+      if (m_address) ::munmap(m_address, m_size);
+    }
+
+    void const* address() const { return m_address; }
+    std::size_t size() const { return m_size; }
+};
+
+template<class TString>
+class text_mapped_file : public text_object<TString> {
+  static_assert(
+    std::is_constructible<typename TString::const_iterator, typename TString::const_pointer>::value,
+    "text_mapped_file needs string iterators constructible from character pointers"
+  );
+
+  private:
+    std::unique_ptr<mapped_region const> const m_region;
+
+    static rope<TString> region_to_rope(mapped_region const& region) {
+      auto const begin = static_cast<typename TString::const_pointer>(region.address());
+      auto const end = begin + region.size() / sizeof(typename TString::value_type);
+
+      return rope<TString>(
+        string_segment<TString>(
+          typename TString::const_iterator(begin),
+          typename TString::const_iterator(end)
+        )
+      );
+    }
+
+    text_mapped_file(std::unique_ptr<mapped_region const> region):
+      text_object<TString>(region_to_rope(*region)),
+      m_region(std::move(region))
+    {
+      TXED_STATS_ONLY(rope_stats::global().source_length += this->length();)
+    }
+
+  public:
+    explicit text_mapped_file(std::string const& path):
+      text_mapped_file(std::unique_ptr<mapped_region const>(new mapped_region(path)))
+    {}
+
+    TXED_STATS_ONLY(~text_mapped_file() { rope_stats::global().source_length -= this->length(); })
+};
+
+//  New contents for the file at a path, written to a temporary file in
+//  the same directory. commit() makes it replace the file; if it is never
+//  called, the temporary file is removed and the file stays as it was.
+class replacement_file {
+  private:
+    std::string const m_path;
+    std::string m_temporary_path;
+    int m_fd;
+
+    replacement_file(replacement_file const&) = delete;
+    replacement_file& operator=(replacement_file const&) = delete;
+
+    std::string directory() const {
+      auto const slash = m_path.find_last_of('/');
+
+      return slash == std::string::npos ? "." : slash == 0 ? "/" : m_path.substr(0, slash);
+    }
+
+    void discard() {
+      ::close(m_fd);
+      ::unlink(m_temporary_path.c_str());
+      m_fd = -1;
+    }
+
+  public:
+    explicit replacement_file(std::string const& path):
+      m_path(path),
+      m_temporary_path(path + ".XXXXXX"),
+      m_fd(::mkstemp(&m_temporary_path[0]))
+    {
+      if (m_fd < 0)
+      {
+        throw os_error("Cannot create a temporary file for " + path);
+      }
+
+      // the new file gets the permissions of the one it replaces
+      struct stat info;
+      auto const mode = ::stat(path.c_str(), &info) == 0 ? info.st_mode & 07777 : 0644;
+
+      if (::fchmod(m_fd, mode) != 0)
+      {
+        auto const error = os_error("Cannot set permissions of " + m_temporary_path);
+        discard();
+        throw error;
+      }
+    }
+
+    ~replacement_file() {
+      if (m_fd >= 0) discard();
+    }
+
+    // writes all of the buffers, however many calls it takes
+    void write(std::vector<iovec>& buffers) {
+      for (std::size_t k = 0; k < buffers.size(); ) {
+        auto const count = std::min<std::size_t>(buffers.size() - k, IOV_MAX);
+        auto written = ::writev(m_fd, &buffers[k], static_cast<int>(count));
+
+        if (written < 0)
+        {
+          if (errno == EINTR) continue;
+
+          throw os_error("Cannot write " + m_temporary_path);
+        }
+
+        for (; k < buffers.size() && static_cast<std::size_t>(written) >= buffers[k].iov_len; ++k) {
+          written -= buffers[k].iov_len;
+        }
+
+        if (written > 0) {
+          buffers[k].iov_base = static_cast<char*>(buffers[k].iov_base) + written;
+          buffers[k].iov_len -= written;
+        }
+      }
+    }
+
+    // flushes the data to disk and renames the temporary file over the target
+    void commit() {
+      if (::fsync(m_fd) != 0)
+      {
+        throw os_error("Cannot flush " + m_temporary_path);
+      }
+
+      if (::close(m_fd) != 0)
+      {
+        m_fd = -1;
+        ::unlink(m_temporary_path.c_str());
+        throw os_error("Cannot close " + m_temporary_path);
+      }
+
+      m_fd = -1;
+
+      if (::rename(m_temporary_path.c_str(), m_path.c_str()) != 0)
+      {
+        auto const error = os_error("Cannot rename " + m_temporary_path + " to " + m_path);
+        ::unlink(m_temporary_path.c_str());
+        throw error;
+      }
+
+      // the rename itself is durable only once the directory is flushed
+      int const dir = ::open(directory().c_str(), O_RDONLY);
+
+      if (dir < 0 || ::fsync(dir) != 0)
+      {
+        auto const error = os_error("Cannot flush the directory of " + m_path);
+        if (dir >= 0) ::close(dir);
+        throw error;
+      }
+
+      ::close(dir);
+    }
+};
+
+// writes the text to the file at path, replacing it atomically
+template<class TString>
+void save(text_object<TString> const& text, std::string const& path) {
+  // segments are passed to writev in batches, so that the list of buffers stays small
+  static std::size_t const batch_length = 4 * IOV_MAX;
+
+  replacement_file file(path);
+  std::vector<iovec> buffers;
+  buffers.reserve(batch_length);
+
+  for (auto const& span : text.spans()) {
+    if (span.second == 0) continue;
+
+    buffers.push_back(iovec {
+      const_cast<void*>(static_cast<void const*>(span.first)),
+      span.second * sizeof(typename TString::value_type)
+    });
+
+    if (buffers.size() == batch_length) {
+      file.write(buffers);
+      buffers.clear();
+    }
+  }
+
+  file.write(buffers);
+  file.commit();
+}
+
+class history_file_error: public std::runtime_error {
+  public:
+    explicit history_file_error(std::string const& path):
+      std::runtime_error("Not a valid history file: " + path)
+    {}
+};
+
+//  Binary image of an edit history: the characters that the revisions
+//  refer to, stored once, followed by the tree nodes of all the ropes,
+//  stored once however many revisions share them, and the revisions with
+//  their roots. Only characters that some revision uses are saved, so the
+//  garbage left in the sources by the old edits is not.
+//
+//  Loading maps the file and rebuilds the nodes and revisions, with their
+//  segments pointing into the mapping, so no text is read or parsed, and
+//  the ropes are not rebuilt by editing them again. The format follows the
+//  byte order and character type of the machine that saved it.
+//
+//  The file is laid out as a header, the buffer table, the node table, the
+//  revision table and the characters; the numbers are 64-bit. In the node
+//  table, children come before their parents and are referred to by index
+//  plus one, 0 being none.
+template<class TString>
+class history_file {
+  static_assert(
+    std::is_constructible<typename TString::const_iterator, typename TString::const_pointer>::value,
+    "history_file needs string iterators constructible from character pointers"
+  );
+
+  private:
+    typedef typename TString::size_type size_type;
+    typedef typename TString::value_type char_type;
+    typedef typename TString::const_pointer pointer;
+    typedef typename TString::const_iterator const_iterator;
+    typedef typename rope<TString>::node_ptr node_ptr;
+    typedef typename rope<TString>::tree_node tree_node;
+    typedef typename text_history<TString>::revision revision;
+    typedef typename text_history<TString>::revision_id revision_id;
+
+    struct header {
+      char magic[8];
+      std::uint64_t char_size;
+      std::uint64_t buffer_count;
+      std::uint64_t node_count;
+      std::uint64_t revision_count;
+      std::uint64_t current;
+      std::uint64_t characters;
+    };
+
+    struct buffer_record {
+      std::uint64_t offset;
+      std::uint64_t length;
+    };
+
+    struct node_record {
+      std::uint64_t left;
+      std::uint64_t right;
+      std::uint64_t buffer;
+      std::uint64_t offset;
+      std::uint64_t length;
+    };
+
+    struct revision_record {
+      std::uint64_t root;
+      std::uint64_t parent;
+      std::uint64_t redo_child;
+    };
+
+    static char const* magic() { return "txedhst1"; }
+
+    // leaf text over one buffer of the mapping, for the storage of the loaded history
+    class mapped_buffer : public text_object<TString> {
+      private:
+        std::shared_ptr<mapped_region const> const m_region;
+
+      public:
+        mapped_buffer(std::shared_ptr<mapped_region const> const& region, pointer begin, size_type length):
+          text_object<TString>(rope<TString>(string_segment<TString>(const_iterator(begin), const_iterator(begin + length)))),
+          m_region(region)
+        {
+          TXED_STATS_ONLY(rope_stats::global().source_length += length;)
+        }
+
+        TXED_STATS_ONLY(~mapped_buffer() { rope_stats::global().source_length -= this->length(); })
+    };
+
+    // a revision as loaded, which has its rope and no base
+    class loaded_text : public text_object<TString> {
+      public:
+        explicit loaded_text(rope<TString> const& r): text_object<TString>(r) {}
+    };
+
+    // gives every node reachable from t an index, children first
+    static std::uint64_t number(
+      tree_node const* t,
+      std::unordered_map<tree_node const*, std::uint64_t>& ids,
+      std::vector<tree_node const*>& nodes
+    ) {
+      if (!t) return 0;
+
+      auto const found = ids.find(t);
+      if (found != ids.end()) return found->second;
+
+      number(t->left.get(), ids, nodes);
+      number(t->right.get(), ids, nodes);
+      nodes.push_back(t);
+
+      return ids[t] = nodes.size();
+    }
+
+    static std::uint64_t id_of(revision_id k) {
+      return k == text_history<TString>::no_revision ? static_cast<std::uint64_t>(-1) : k;
+    }
+
+    static revision_id revision_of(std::uint64_t k) {
+      return k == static_cast<std::uint64_t>(-1) ? text_history<TString>::no_revision : static_cast<revision_id>(k);
+    }
+
+    static iovec buffer_of(void const* data, std::size_t size) {
+      return iovec { const_cast<void*>(data), size };
+    }
+
+  public:
+    static void save(text_history<TString> const& history, std::string const& path) {
+      std::unordered_map<tree_node const*, std::uint64_t> ids;
+      std::vector<tree_node const*> nodes;
+      std::vector<revision_record> revisions;
+
+      for (auto const& r : history.m_revisions) {
+        auto const root = number(r.text->get_rope().m_root.get(), ids, nodes);
+        revisions.push_back(revision_record { root, id_of(r.parent), id_of(r.redo_child) });
+      }
+
+      // the characters in use, as ranges of memory that the segments fall into
+      std::less<pointer> const before;
+      std::vector<std::pair<pointer, pointer> > used;
+
+      for (auto t : nodes) {
+        auto const s = t->segment();
+        auto const begin = std::addressof(*s.first);
+        used.push_back(std::make_pair(begin, begin + (s.second - s.first)));
+      }
+
+      std::sort(used.begin(), used.end(), [&before](std::pair<pointer, pointer> const& x, std::pair<pointer, pointer> const& y) {
+        return before(x.first, y.first);
+      });
+
+      std::vector<std::pair<pointer, pointer> > buffers;
+
+      for (auto const& u : used) {
+        if (!buffers.empty() && !before(buffers.back().second, u.first)) {
+          if (before(buffers.back().second, u.second)) buffers.back().second = u.second;
+        } else {
+          buffers.push_back(u);
+        }
+      }
+
+      std::vector<buffer_record> buffer_table;
+      std::uint64_t characters = 0;
+
+      for (auto const& b : buffers) {
+        std::uint64_t const length = b.second - b.first;
+        buffer_table.push_back(buffer_record { characters, length });
+        characters += length;
+      }
+
+      std::vector<node_record> node_table;
+
+      for (auto t : nodes) {
+        auto const s = t->segment();
+        auto const begin = std::addressof(*s.first);
+
+        auto const b = std::upper_bound(buffers.begin(), buffers.end(), begin, [&before](pointer x, std::pair<pointer, pointer> const& y) {
+          return before(x, y.first);
+        }) - buffers.begin() - 1;
+
+        node_table.push_back(node_record {
+          ids.count(t->left.get()) ? ids[t->left.get()] : 0,
+          ids.count(t->right.get()) ? ids[t->right.get()] : 0,
+          static_cast<std::uint64_t>(b),
+          static_cast<std::uint64_t>(begin - buffers[b].first),
+          static_cast<std::uint64_t>(s.second - s.first)
+        });
+      }
+
+      header h;
+      std::memcpy(h.magic, magic(), sizeof(h.magic));
+      h.char_size = sizeof(char_type);
+      h.buffer_count = buffer_table.size();
+      h.node_count = node_table.size();
+      h.revision_count = revisions.size();
+      h.current = history.m_current;
+      h.characters = characters;
+
+      std::vector<iovec> parts;
+      parts.push_back(buffer_of(&h, sizeof(h)));
+      parts.push_back(buffer_of(buffer_table.data(), buffer_table.size() * sizeof(buffer_record)));
+      parts.push_back(buffer_of(node_table.data(), node_table.size() * sizeof(node_record)));
+      parts.push_back(buffer_of(revisions.data(), revisions.size() * sizeof(revision_record)));
+
+      // the characters go from where they are, uncopied
+      for (auto const& b : buffers) parts.push_back(buffer_of(b.first, (b.second - b.first) * sizeof(char_type)));
+
+      replacement_file file(path);
+      file.write(parts);
+      file.commit();
+    }
+
+    static std::unique_ptr<text_history<TString> > load(
+      std::string const& path,
+      history_limits const& limits = history_limits::unlimited()
+    ) {
+      auto const region = std::make_shared<mapped_region const>(path);
+      auto const base = static_cast<char const*>(region->address());
+      auto const size = region->size();
+
+      header h;
+
+      if (size < sizeof(h))
+      {
+        throw history_file_error(path);
+      }
+
+      std::memcpy(&h, base, sizeof(h));
+
+      // sizes are checked one by one, so that none of the products can overflow
+      std::uint64_t const limit = size;
+
+      if (
+        std::memcmp(h.magic, magic(), sizeof(h.magic)) != 0 || h.char_size != sizeof(char_type) ||
+        h.buffer_count > limit / sizeof(buffer_record) || h.node_count > limit / sizeof(node_record) ||
+        h.revision_count > limit / sizeof(revision_record) || h.characters > limit / sizeof(char_type) ||
+        h.revision_count == 0 || h.current >= h.revision_count
+      )
+      {
+        throw history_file_error(path);
+      }
+
+      auto const buffers_at = sizeof(h);
+      auto const nodes_at = buffers_at + h.buffer_count * sizeof(buffer_record);
+      auto const revisions_at = nodes_at + h.node_count * sizeof(node_record);
+      auto const characters_at = revisions_at + h.revision_count * sizeof(revision_record);
+
+      if (characters_at > size || (size - characters_at) / sizeof(char_type) != h.characters)
+      {
+        throw history_file_error(path);
+      }
+
+      auto const characters = reinterpret_cast<pointer>(base + characters_at);
+
+      std::unique_ptr<text_history<TString> > result(new text_history<TString>(limits));
+      result->m_storage = std::make_shared<typename text_history<TString>::storage>();
+      result->m_arena = std::make_shared<rope_arena>();
+
+      rope_arena::scope const in_arena(result->m_arena);
+
+      std::vector<buffer_record> buffer_table(h.buffer_count);
+      if (h.buffer_count) std::memcpy(buffer_table.data(), base + buffers_at, h.buffer_count * sizeof(buffer_record));
+
+      for (auto const& b : buffer_table) {
+        if (b.offset > h.characters || b.length > h.characters - b.offset)
+        {
+          throw history_file_error(path);
+        }
+
+        result->m_storage->sources.push_back(std::make_shared<mapped_buffer const>(region, characters + b.offset, b.length));
+      }
+
+      std::vector<node_ptr> nodes;
+      nodes.reserve(h.node_count);
+
+      for (std::uint64_t k = 0; k < h.node_count; ++k) {
+        node_record n;
+        std::memcpy(&n, base + nodes_at + k * sizeof(n), sizeof(n));
+
+        if (
+          n.left > k || n.right > k || n.buffer >= h.buffer_count ||
+          n.length == 0 || n.length > rope<TString>::max_segment_length ||
+          n.offset > buffer_table[n.buffer].length || n.length > buffer_table[n.buffer].length - n.offset
+        )
+        {
+          throw history_file_error(path);
+        }
+
+        auto const left = n.left ? nodes[n.left - 1] : node_ptr();
+        auto const right = n.right ? nodes[n.right - 1] : node_ptr();
+
+        // children shared by a node can double the length at every level,
+        // so the sum is checked before the node is made, and so is the balance
+        auto const max_length = std::numeric_limits<size_type>::max();
+        auto const left_length = rope<TString>::length_of(left);
+        auto const right_length = rope<TString>::length_of(right);
+        auto const left_height = rope<TString>::height_of(left);
+        auto const right_height = rope<TString>::height_of(right);
+
+        if (
+          left_length > max_length - n.length || right_length > max_length - n.length - left_length ||
+          left_height > right_height + 1 || right_height > left_height + 1
+        )
+        {
+          throw history_file_error(path);
+        }
+
+        auto const begin = characters + buffer_table[n.buffer].offset + n.offset;
+
+        nodes.push_back(rope<TString>::make_node(
+          left,
+          rope<TString>::unknown_info(string_segment<TString>(const_iterator(begin), const_iterator(begin + n.length))),
+          right
+        ));
+      }
+
+      for (std::uint64_t k = 0; k < h.revision_count; ++k) {
+        revision_record r;
+        std::memcpy(&r, base + revisions_at + k * sizeof(r), sizeof(r));
+
+        auto const parent = revision_of(r.parent);
+        auto const redo_child = revision_of(r.redo_child);
+
+        // a parent always precedes its children
+        if (
+          r.root > h.node_count ||
+          (k == 0) != (parent == text_history<TString>::no_revision) ||
+          (parent != text_history<TString>::no_revision && parent >= k) ||
+          (redo_child != text_history<TString>::no_revision && (redo_child <= k || redo_child >= h.revision_count))
+        )
+        {
+          throw history_file_error(path);
+        }
+
+        auto const text = std::allocate_shared<loaded_text>(
+          arena_allocator<loaded_text>(result->m_arena),
+          rope<TString>(r.root ? nodes[r.root - 1] : node_ptr())
+        );
+
+        result->m_revisions.push_back(revision { text, parent, redo_child });
+      }
+
+      result->m_current = static_cast<revision_id>(h.current);
+
+      return result;
+    }
+};
+
+// saves the snapshot on a thread of its own, so that editing can go on;
+// the future rethrows whatever error the saving ran into
+template<class TString>
+std::future<void> save_async(text_snapshot<TString> const& snapshot, std::string const& path) {
+  return std::async(std::launch::async, [snapshot, path]() { save(*snapshot, path); });
+}
+
+};
+
+#endif
@@ -0,0 +1,177 @@
+//  Parallel algorithms for the text editor object model.
+//
+//  Text objects are immutable, so any number of threads can read one
+//  without locking. The algorithms below cut the text into ranges of
+//  roughly equal length, aligned to segment ends, and let a fixed set of
+//  worker threads take the ranges one by one; the partial results are
+//  then combined in text order.
+
+#ifndef TXED_PARALLEL_H
+#define TXED_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "txed.h"
+
+namespace text_edit {
+
+template<class TString>
+class text_partition {
+  private:
+    std::vector<typename TString::size_type> m_bounds;
+
+  public:
+    // several ranges per thread, so that a thread that finishes early takes more work
+    static std::size_t const ranges_per_thread = 4;
+
+    text_partition(text_object<TString> const& text, std::size_t ranges) {
+      auto const& r = text.get_rope();
+      auto const length = text.length();
+
+      m_bounds.push_back(0);
+
+      for (std::size_t k = 1; k < ranges; ++k) {
+        auto const target = length / ranges * k;
+        auto const it = r.upper_bound(target);
+        auto const bound = it == r.end() ? length : it->first;
+
+        if (bound > m_bounds.back() && bound < length) m_bounds.push_back(bound);
+      }
+
+      m_bounds.push_back(length);
+    }
+
+    std::size_t size() const { return m_bounds.size() - 1; }
+    typename TString::size_type begin(std::size_t k) const { return m_bounds[k]; }
+    typename TString::size_type end(std::size_t k) const { return m_bounds[k + 1]; }
+};
+
+inline unsigned default_thread_count() {
+  auto const n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+// calls task(k) for every k in [0, count) on up to threads threads;
+// the first exception thrown by a task is rethrown once all threads are done
+template<class TTask>
+void parallel_for(std::size_t count, unsigned threads, TTask task) {
+  std::atomic<std::size_t> next(0);
+  std::exception_ptr error;
+  std::atomic<bool> failed(false);
+
+  auto const work = [&]() {
+    for (std::size_t k; !failed && (k = next++) < count; ) {
+      try {
+        task(k);
+      } catch (...) {
+        if (!failed.exchange(true)) error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  auto const extra = std::min<std::size_t>(threads ? threads : 1, count) - (count ? 1 : 0);
+
+  for (std::size_t i = 0; i < extra; ++i) workers.emplace_back(work);
+
+  work();
+
+  for (auto& w : workers) w.join();
+
+  if (error) std::rethrow_exception(error);
+}
+
+template<class TString>
+typename TString::size_type parallel_count(
+  text_object<TString> const& text,
+  typename TString::value_type c,
+  unsigned threads = default_thread_count()
+) {
+  text_partition<TString> const partition(text, threads * text_partition<TString>::ranges_per_thread);
+  std::vector<typename TString::size_type> counts(partition.size(), 0);
+  auto const& r = text.get_rope();
+
+  parallel_for(partition.size(), threads, [&](std::size_t k) {
+    auto const view = rope_trimmed_range<TString>(&r, partition.begin(k), partition.end(k), 0);
+    auto const last = view.end();
+
+    for (auto it = view.begin(); it != last; ++it) {
+      rope_node<TString> const node = *it;
+      counts[k] += std::count(node.second.first, node.second.second, c);
+    }
+  });
+
+  typename TString::size_type result = 0;
+  for (auto n : counts) result += n;
+  return result;
+}
+
+template<class TString>
+typename TString::size_type parallel_count_lines(
+  text_object<TString> const& text,
+  unsigned threads = default_thread_count()
+) {
+  return parallel_count(text, typename TString::value_type('\n'), threads) + 1;
+}
+
+// same result as text.find_all(needle)
+template<class TString>
+std::vector<typename TString::size_type> parallel_find_all(
+  text_object<TString> const& text,
+  TString const& needle,
+  unsigned threads = default_thread_count()
+) {
+  typedef typename TString::size_type size_type;
+
+  text_partition<TString> const partition(text, threads * text_partition<TString>::ranges_per_thread);
+  std::vector<std::vector<size_type> > hits(partition.size());
+
+  parallel_for(partition.size(), threads, [&](std::size_t k) {
+    text.scan(needle, partition.begin(k), partition.end(k), [&hits, k](size_type offset) {
+      hits[k].push_back(offset);
+      return true;
+    });
+  });
+
+  std::vector<size_type> result;
+
+  for (std::size_t k = 0; k < hits.size(); ++k) {
+    auto const& h = hits[k];
+    auto const resume = result.empty() ? 0 : result.back() + needle.length();
+    auto from = h.begin();
+
+    // a match running over the start of the range hides the ones it overlaps,
+    // so rescan until the matches fall in step with those found independently
+    if (from != h.end() && *from < resume) {
+      bool in_step = false;
+
+      if (resume < partition.end(k)) {
+        text.scan(needle, resume, partition.end(k), [&](size_type offset) {
+          from = std::lower_bound(from, h.end(), offset);
+          in_step = from != h.end() && *from == offset;
+
+          if (!in_step) result.push_back(offset);
+
+          return !in_step;
+        });
+      }
+
+      if (!in_step) from = h.end();
+    }
+
+    result.insert(result.end(), from, h.end());
+  }
+
+  return result;
+}
+
+template<class TString> std::size_t const text_partition<TString>::ranges_per_thread;
+
+};
+
+#endif